@@ -1,93 +1,1357 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <compare>
+#include <charconv>
+#include <concepts>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "frozenmap.h"
+#include "mapfile.h"
+#include "nodepool.h"
 
 using namespace std;
 
-template <typename KeyT, typename ValT>
+// Balancing policies for BSTMap. NoBalance is the plain BST; AVLBalance
+// rebalances on every insert/erase so the height stays within ~1.44 log2(n).
+struct NoBalance {
+  struct NodeData {};
+};
+
+struct AVLBalance {
+  struct NodeData {
+    int height = 1;
+  };
+};
+
+// SplayBalance is self-adjusting: at(), find() and contains() semi-splay
+// the path to the node they find, and insert does the same for the node it
+// adds, so hot keys gather near the top and repeated hits on them get cheap.
+// Erase unlinks as in the plain tree. Lookups restructure the
+// tree, so a SplayBalance map must not be read by several threads at once.
+struct SplayBalance {
+  struct NodeData {};
+};
+
+// Statistics policies for BSTMap. NoStats compiles every counter out;
+// CountStats tallies comparisons, search path lengths and node allocations
+// for stats(). Counting writes to the map even on const lookups, so a
+// CountStats map must not be read by several threads at once, and its set
+// operations run on a single thread.
+struct NoStats {};
+struct CountStats {};
+
+// Default BSTMap comparator: a <=> b where the operands have it, otherwise
+// an ordering derived from <. It is transparent, so lookups accept anything
+// comparable with the key, such as a C string for string keys.
+struct SynthThreeWay {
+  using is_transparent = void;
+
+  template <typename A, typename B>
+  constexpr auto operator()(const A& a, const B& b) const {
+    if constexpr (requires { a <=> b; }) {
+      return a <=> b;
+    } else {
+      if (a < b) return weak_ordering::less;
+      if (b < a) return weak_ordering::greater;
+      return weak_ordering::equivalent;
+    }
+  }
+};
+
+// What BSTMap::stats() reports. The operation counters are only kept under
+// CountStats and read zero otherwise; the shape fields are measured by
+// walking the tree on every call.
+struct BSTMapStats {
+  size_t comparisons = 0;    // comparator calls
+  size_t lookups = 0;        // key searches by at, contains, find and find_batch
+  size_t lookup_visits = 0;  // nodes visited by those searches
+  size_t inserts = 0;        // key searches by insert, try_emplace and emplace
+  size_t insert_visits = 0;
+  size_t erases = 0;  // key searches by erase(key)
+  size_t erase_visits = 0;
+  size_t allocations = 0;  // nodes created
+  size_t frees = 0;        // nodes destroyed
+
+  size_t size = 0;
+  size_t height = 0;
+  vector<size_t> depth_histogram;  // entry d counts the nodes d levels below the root
+  double average_path_length = 0;  // mean nodes on the path from the root to an entry
+};
+
+// Compare is either a three-way comparator returning an ordering, which the
+// tree calls once per level, or a less-than predicate, which costs a second
+// call on the way down whenever the first one says "not less".
+template <typename KeyT, typename ValT, typename Balance = NoBalance,
+          typename Alloc = NodePool<pair<const KeyT, ValT>>, typename Compare = SynthThreeWay,
+          typename Stats = NoStats>
 class BSTMap {
  private:
-  struct BSTNode {
+  struct BSTNode : Balance::NodeData {
     const KeyT key;  // Key is fixed after creation
     ValT value;
     BSTNode* parent;
     BSTNode* left;
     BSTNode* right;
+    size_t count = 1;  // Nodes in the subtree rooted here
+
+    template <typename K, typename... Args>
+    BSTNode(BSTNode* parent, K&& key, Args&&... args)
+        : key(std::forward<K>(key)),
+          value(std::forward<Args>(args)...),
+          parent(parent),
+          left(nullptr),
+          right(nullptr) {}
+  };
+
+  using NodeAlloc = typename allocator_traits<Alloc>::template rebind_alloc<BSTNode>;
+  using NodeTraits = allocator_traits<NodeAlloc>;
+
+  static constexpr bool isAVL = is_same_v<Balance, AVLBalance>;
+  static constexpr bool isSplay = is_same_v<Balance, SplayBalance>;
+
+  // Searches a batched lookup keeps in flight at once.
+  static constexpr size_t BatchWidth = 16;
+
+  // Set operations hand a half to another thread only if both halves have
+  // at least this many nodes.
+  static constexpr size_t ParallelCutoff = 8192;
+
+  // Lookups take other key types only if the comparator says it handles them.
+  static constexpr bool isTransparent = requires { typename Compare::is_transparent; };
+
+  static constexpr bool isCounting = is_same_v<Stats, CountStats>;
+
+  // Key searches whose visited nodes are tallied separately.
+  enum SearchKind { Lookup, Insert, Erase };
+
+  struct Counters {
+    size_t comparisons = 0;
+    size_t searches[3] = {};
+    size_t visits[3] = {};
+    size_t allocations = 0;
+    size_t frees = 0;
+  };
+
+  // FrozenMap takes a less-than predicate: plain < for the default
+  // comparator, which keeps its vector compares, Compare itself when it is
+  // one, and otherwise a wrapper that tests the three-way result.
+  struct FrozenLess {
+    [[no_unique_address]] Compare comp;
+    bool operator()(const KeyT& a, const KeyT& b) const { return comp(a, b) < 0; }
+  };
+
+  static constexpr bool isLessPredicate = is_same_v<invoke_result_t<const Compare&, const KeyT&, const KeyT&>, bool>;
+
+  using FrozenCompare = conditional_t<is_same_v<Compare, SynthThreeWay>, less<KeyT>,
+                                      conditional_t<isLessPredicate, Compare, FrozenLess>>;
 
-    BSTNode(KeyT key, ValT value, BSTNode* parent)
-        : key(key), value(value), parent(parent), left(nullptr), right(nullptr) {}
+  // save() writes keys and values as flat arrays when both are stored as
+  // raw bytes; load() then builds straight from the mapped file.
+  static constexpr bool isRawFile = requires {
+    requires MapCodec<KeyT>::is_raw && MapCodec<ValT>::is_raw;
+    requires alignof(KeyT) <= MapFileHeader::DataOffset && alignof(ValT) <= MapFileHeader::DataOffset;
   };
 
-  BSTNode* root;
+  mutable BSTNode* root;  // const lookups splay under SplayBalance
   size_t sz;
   BSTNode* curr;
+  BSTNode* minNode = nullptr;  // leftmost and rightmost nodes, kept current
+  BSTNode* maxNode = nullptr;  // by every mutation
+  [[no_unique_address]] NodeAlloc alloc;
+  [[no_unique_address]] Compare comp;
+  [[no_unique_address]] mutable conditional_t<isCounting, Counters, NoStats> counters;
 
-  BSTNode* findNode(const KeyT& key) const {
+  template <typename A, typename B>
+  auto callComp(const A& a, const B& b) const {
+    if constexpr (isCounting) counters.comparisons++;
+    return comp(a, b);
+  }
+
+  template <typename A, typename B>
+  auto compareKeys(const A& a, const B& b) const {
+    if constexpr (is_same_v<decltype(comp(a, b)), bool>) {
+      if (callComp(a, b)) return weak_ordering::less;
+      if (callComp(b, a)) return weak_ordering::greater;
+      return weak_ordering::equivalent;
+    } else {
+      return callComp(a, b);
+    }
+  }
+
+  template <typename... Args>
+  BSTNode* newNode(Args&&... args) {
+    BSTNode* node = NodeTraits::allocate(alloc, 1);
+    try {
+      NodeTraits::construct(alloc, node, std::forward<Args>(args)...);
+    } catch (...) {
+      NodeTraits::deallocate(alloc, node, 1);
+      throw;
+    }
+    if constexpr (isCounting) counters.allocations++;
+    return node;
+  }
+
+  void deleteNode(BSTNode* node) {
+    if constexpr (isCounting) counters.frees++;
+    NodeTraits::destroy(alloc, node);
+    NodeTraits::deallocate(alloc, node, 1);
+  }
+
+  // A pooled allocator that nobody else shares can drop all of its chunks
+  // at once, so clearing only has to visit nodes that need destructors.
+  // Nodes the pool does not carve from chunks (over-aligned or a different
+  // slot size) are not covered by that and must be freed one by one.
+  bool canReleasePool() const {
+    if constexpr (requires(NodeAlloc& a) { a.release(); a.sole_owner(); a.pooled(); })
+      return alloc.sole_owner() && alloc.pooled();
+    else
+      return false;
+  }
+
+  // Tallies a search that ended at node by climbing back to the root, so
+  // the descent loop itself carries no counter updates (which would make
+  // the compiler turn the child choice into a conditional move and stall
+  // each step on its compare).
+  void countSearch(SearchKind kind, BSTNode* node) const {
+    if constexpr (isCounting) {
+      counters.searches[kind]++;
+      for (; node; node = node->parent) counters.visits[kind]++;
+    }
+  }
+
+  template <typename K>
+  BSTNode* findNode(const K& key, SearchKind kind = Lookup) const {
     BSTNode* current = root;
+    BSTNode* last = nullptr;
     while (current != nullptr) {
-      if (key == current->key) return current;
-      else if (key < current->key) current = current->left;
-      else current = current->right;
+      auto order = compareKeys(key, current->key);
+      if (order == 0) break;
+      if constexpr (isCounting) last = current;
+      current = order < 0 ? current->left : current->right;
     }
-    return nullptr;
+    countSearch(kind, current ? current : last);
+    if constexpr (isSplay) {
+      if (current && kind == Lookup) splay(current);
+    }
+    return current;
   }
 
-  void clearHelper(BSTNode* node) {
-    if (!node) return;
-    clearHelper(node->left);
-    clearHelper(node->right);
-    delete node;
+  // Runs the searches for keys[0..n), n <= BatchWidth, side by side: each
+  // round moves every unfinished search down one level and prefetches the
+  // node it lands on, so the cache misses of the group overlap instead of
+  // queueing behind each other. found[i] is the node holding keys[i].
+  void findGroup(const KeyT* keys, size_t n, BSTNode** found) const {
+    BSTNode* cursor[BatchWidth];
+    if constexpr (isCounting) counters.searches[Lookup] += n;
+    for (size_t i = 0; i < n; i++) {
+      cursor[i] = root;
+      found[i] = nullptr;
+    }
+    for (size_t active = root ? n : 0; active > 0;) {
+      active = 0;
+      for (size_t i = 0; i < n; i++) {
+        BSTNode* node = cursor[i];
+        if (!node) continue;
+        if constexpr (isCounting) counters.visits[Lookup]++;
+        auto order = compareKeys(keys[i], node->key);
+        if (order == 0) {
+          found[i] = node;
+          node = nullptr;
+        } else {
+          node = order < 0 ? node->left : node->right;
+        }
+        if (node) {
+          __builtin_prefetch(node);
+          active++;
+        }
+        cursor[i] = node;
+      }
+    }
+  }
+
+  // Returns the node holding key, or nullptr with parent set to the node a
+  // new entry for key would hang from and left to the side it goes on.
+  BSTNode* findSlot(const KeyT& key, BSTNode*& parent, bool& left) const {
+    BSTNode* current = root;
+    parent = nullptr;
+    left = false;
+    while (current) {
+      auto order = compareKeys(key, current->key);
+      if (order == 0) break;
+      parent = current;
+      left = order < 0;
+      current = left ? current->left : current->right;
+    }
+    countSearch(Insert, current ? current : parent);
+    return current;
+  }
+
+  // Finger search: like findSlot, but starts at start and climbs only until
+  // key falls inside a subtree on the way up before searching down it.
+  // Keys d entries away usually share an ancestor about log2 d levels up,
+  // so nearby keys take O(log d) comparisons on average. The climb passes
+  // the other ancestors without comparing, but it still follows their
+  // parent links, and a key across a high subtree boundary climbs to the
+  // root: about two root searches in the worst case.
+  BSTNode* findNear(BSTNode* start, const KeyT& key, BSTNode*& parent, bool& left, SearchKind kind) const {
+    size_t visits = 1;
+    auto order = compareKeys(key, start->key);
+    left = false;
+    BSTNode* node = start;
+    BSTNode* current = nullptr;
+    parent = start->parent;
+    if (order == 0) {
+      current = start;
+    } else {
+      bool right = order > 0;
+      // Nothing bounds the extremes, so appending past them never climbs.
+      bool unbounded = start == (right ? maxNode : minNode);
+      // node's subtree is bounded on key's side by the first ancestor that
+      // node's branch hangs below on the far side; nearer ancestors share
+      // that bound and are passed unchecked. While key lies beyond the
+      // bound, that ancestor's subtree is the next candidate.
+      BSTNode* below = node;
+      for (BSTNode* up = unbounded ? nullptr : node->parent; up; below = up, up = up->parent) {
+        if ((up->left == below) != right) continue;
+        visits++;
+        auto bound = compareKeys(key, up->key);
+        if (bound == 0) current = up;
+        if (bound == 0 || (bound > 0) != right) break;
+        node = up;
+      }
+      if (!current) {
+        // key is inside node's subtree, on the same side of node as of start.
+        parent = node;
+        left = !right;
+        current = left ? node->left : node->right;
+        while (current) {
+          visits++;
+          auto step = compareKeys(key, current->key);
+          if (step == 0) break;
+          parent = current;
+          left = step < 0;
+          current = left ? current->left : current->right;
+        }
+      } else {
+        parent = current->parent;
+      }
+    }
+    if constexpr (isCounting) {
+      counters.searches[kind]++;
+      counters.visits[kind] += visits;
+    }
+    if constexpr (isSplay) {
+      if (current && kind == Lookup) splay(current);
+    }
+    return current;
+  }
+
+  static BSTNode* leftmost(BSTNode* node) {
+    while (node->left) node = node->left;
+    return node;
+  }
+
+  static BSTNode* rightmost(BSTNode* node) {
+    while (node->right) node = node->right;
+    return node;
+  }
+
+  static BSTNode* predecessor(BSTNode* node) {
+    if (node->left) return rightmost(node->left);
+    BSTNode* parent = node->parent;
+    while (parent && node == parent->left) {
+      node = parent;
+      parent = parent->parent;
+    }
+    return parent;
+  }
+
+  static BSTNode* successor(BSTNode* node) {
+    if (node->right) return leftmost(node->right);
+    BSTNode* parent = node->parent;
+    while (parent && node == parent->right) {
+      node = parent;
+      parent = parent->parent;
+    }
+    return parent;
+  }
+
+  // Calls fn(node, depth) for every node in pre-order, root at depth 1.
+  // Walks parent pointers instead of recursing so deep trees are safe.
+  template <typename Fn>
+  void visitPreorder(Fn fn) const {
+    BSTNode* node = root;
+    BSTNode* prev = nullptr;
+    size_t depth = 0;
+    while (node) {
+      BSTNode* next;
+      if (prev == node->parent) {
+        fn(node, ++depth);
+        next = node->left ? node->left : node->right ? node->right : node->parent;
+      } else if (prev == node->left && node->right) {
+        next = node->right;
+      } else {
+        next = node->parent;
+      }
+      if (next == node->parent) depth--;
+      prev = node;
+      node = next;
+    }
+  }
+
+  // Frees the subtree rooted at node, whose parent link must be null. With
+  // destroyOnly the memory is left to a pool release by the caller.
+  void clearHelper(BSTNode* node, bool destroyOnly = false) {
+    while (node) {
+      if (node->left) {
+        node = node->left;
+      } else if (node->right) {
+        node = node->right;
+      } else {
+        BSTNode* parent = node->parent;
+        if (parent && parent->left == node) parent->left = nullptr;
+        else if (parent) parent->right = nullptr;
+        if (!destroyOnly) {
+          deleteNode(node);
+        } else {
+          if constexpr (isCounting) counters.frees++;
+          NodeTraits::destroy(alloc, node);
+        }
+        node = parent;
+      }
+    }
+  }
+
+  BSTNode* cloneNode(BSTNode* otherNode, BSTNode* parent) {
+    BSTNode* node = newNode(parent, otherNode->key, otherNode->value);
+    static_cast<typename Balance::NodeData&>(*node) = *otherNode;
+    node->count = otherNode->count;
+    return node;
   }
 
   void copyHelper(BSTNode*& node, BSTNode* otherNode, BSTNode* parent) {
-    if (!otherNode) {
+    node = nullptr;
+    if (!otherNode) return;
+    node = cloneNode(otherNode, parent);
+    try {
+      BSTNode* src = otherNode;
+      BSTNode* dst = node;
+      while (dst != parent) {
+        if (src->left && !dst->left) {
+          dst->left = cloneNode(src->left, dst);
+          src = src->left;
+          dst = dst->left;
+        } else if (src->right && !dst->right) {
+          dst->right = cloneNode(src->right, dst);
+          src = src->right;
+          dst = dst->right;
+        } else {
+          src = src->parent;
+          dst = dst->parent;
+        }
+      }
+    } catch (...) {
+      clearHelper(node);
       node = nullptr;
+      throw;
+    }
+  }
+
+  // Types whose operator<< output on a default-formatted stream can be
+  // produced directly: numbers (but not bool or characters) and strings.
+  template <typename T>
+  static constexpr bool isPlainText =
+      (is_arithmetic_v<T> && !is_same_v<T, bool> && !is_same_v<T, char> && !is_same_v<T, signed char> &&
+       !is_same_v<T, unsigned char> && !is_same_v<T, wchar_t> && !is_same_v<T, char8_t> &&
+       !is_same_v<T, char16_t> && !is_same_v<T, char32_t>) ||
+      is_convertible_v<const T&, string_view>;
+
+  // Appends value to buffer as operator<< would print it, or streams it
+  // after whatever is buffered when os is formatted differently.
+  template <typename T>
+  static void writeText(ostream& os, string& buffer, bool plain, const T& value) {
+    if constexpr (isPlainText<T>) {
+      if (plain) {
+        if constexpr (is_convertible_v<const T&, string_view>) {
+          buffer += string_view(value);
+        } else {
+          char text[64];
+          to_chars_result result;
+          if constexpr (is_floating_point_v<T>) {
+            result = to_chars(text, text + sizeof(text), value, chars_format::general, 6);
+          } else {
+            result = to_chars(text, text + sizeof(text), value);
+          }
+          buffer.append(text, result.ptr);
+        }
+        return;
+      }
+    }
+    os.write(buffer.data(), buffer.size());
+    buffer.clear();
+    os << value;
+  }
+
+  static int heightOf(BSTNode* node) {
+    if constexpr (isAVL) return node ? node->height : 0;
+    else return 0;
+  }
+
+  static size_t countOf(BSTNode* node) { return node ? node->count : 0; }
+
+  static void updateNode(BSTNode* node) {
+    node->count = 1 + countOf(node->left) + countOf(node->right);
+    if constexpr (isAVL) node->height = 1 + max(heightOf(node->left), heightOf(node->right));
+  }
+
+  // Re-derives the cached extremes after an operation that rebuilt the tree.
+  void refreshEnds() {
+    minNode = root ? leftmost(root) : nullptr;
+    maxNode = root ? rightmost(root) : nullptr;
+  }
+
+  // Points whatever referenced oldChild (parent link or root) at newChild.
+  void replaceChild(BSTNode* parent, BSTNode* oldChild, BSTNode* newChild) {
+    if (!parent) root = newChild;
+    else if (parent->left == oldChild) parent->left = newChild;
+    else parent->right = newChild;
+    if (newChild) newChild->parent = parent;
+  }
+
+  // Rotations and balanceNode work on the subtree below node only: the
+  // returned subtree root inherits node's parent pointer, and re-linking
+  // it into that parent is left to the caller.
+  static BSTNode* rotateLeft(BSTNode* node) {
+    BSTNode* pivot = node->right;
+    node->right = pivot->left;
+    if (pivot->left) pivot->left->parent = node;
+    pivot->left = node;
+    pivot->parent = node->parent;
+    node->parent = pivot;
+    updateNode(node);
+    updateNode(pivot);
+    return pivot;
+  }
+
+  static BSTNode* rotateRight(BSTNode* node) {
+    BSTNode* pivot = node->left;
+    node->left = pivot->right;
+    if (pivot->right) pivot->right->parent = node;
+    pivot->right = node;
+    pivot->parent = node->parent;
+    node->parent = pivot;
+    updateNode(node);
+    updateNode(pivot);
+    return pivot;
+  }
+
+  // Rotates node above its parent and links it into the grandparent.
+  void rotateUp(BSTNode* node) const {
+    BSTNode* parent = node->parent;
+    BSTNode* grand = parent->parent;
+    BSTNode* top = parent->left == node ? rotateRight(parent) : rotateLeft(parent);
+    if (!grand) root = top;
+    else if (grand->left == parent) grand->left = top;
+    else grand->right = top;
+  }
+
+  // Semi-splays the path from node to the root, two levels per step. When
+  // node and its parent are both left or both right children, only the
+  // parent rotates up and the walk continues from it (zig-zig); otherwise
+  // node rotates up twice (zig-zag). This roughly halves the depth of every
+  // node on the path with about half the rotations of a full splay. Each
+  // node on the old path is rotated below the walk and has its count
+  // recomputed on the way, so the path's counts need not be current.
+  void splay(BSTNode* node) const {
+    while (BSTNode* parent = node->parent) {
+      BSTNode* grand = parent->parent;
+      if (!grand) {
+        rotateUp(node);
+      } else if ((grand->left == parent) == (parent->left == node)) {
+        rotateUp(parent);
+        node = parent;
+      } else {
+        rotateUp(node);
+        rotateUp(node);
+      }
+    }
+  }
+
+  // Refreshes node's subtree data and, under AVLBalance, fixes an imbalance
+  // of two at node with a single or double rotation.
+  static BSTNode* balanceNode(BSTNode* node) {
+    updateNode(node);
+    if constexpr (isAVL) {
+      int balance = heightOf(node->left) - heightOf(node->right);
+      if (balance > 1) {
+        if (heightOf(node->left->left) < heightOf(node->left->right)) node->left = rotateLeft(node->left);
+        return rotateRight(node);
+      }
+      if (balance < -1) {
+        if (heightOf(node->right->right) < heightOf(node->right->left)) node->right = rotateRight(node->right);
+        return rotateLeft(node);
+      }
+    }
+    return node;
+  }
+
+  // Refreshes subtree counts (and heights) on the path from node up to the
+  // root after a structural change below node, rotating where the balance
+  // policy asks for it.
+  void rebalance(BSTNode* node) {
+    while (node) {
+      BSTNode* parent = node->parent;
+      BSTNode* top = balanceNode(node);
+      if (top != node) replaceChild(parent, node, top);
+      node = parent;
+    }
+  }
+
+  // The join/split helpers below work on detached subtrees: the parent link
+  // of a returned subtree root is unspecified and must be set by the caller.
+
+  // Combines l < pivot < r into one subtree. Under AVLBalance pivot is
+  // placed on the spine of the taller side so the result stays balanced.
+  BSTNode* joinTrees(BSTNode* l, BSTNode* pivot, BSTNode* r) {
+    if constexpr (isAVL) {
+      if (heightOf(l) > heightOf(r) + 1) {
+        l->right = joinTrees(l->right, pivot, r);
+        l->right->parent = l;
+        return balanceNode(l);
+      }
+      if (heightOf(r) > heightOf(l) + 1) {
+        r->left = joinTrees(l, pivot, r->left);
+        r->left->parent = r;
+        return balanceNode(r);
+      }
+    }
+    pivot->left = l;
+    pivot->right = r;
+    if (l) l->parent = pivot;
+    if (r) r->parent = pivot;
+    updateNode(pivot);
+    return pivot;
+  }
+
+  // Joins l < r without a pivot by borrowing r's smallest node. The left
+  // spine of r is climbed back through parent pointers, so nothing is
+  // allocated.
+  BSTNode* joinTrees(BSTNode* l, BSTNode* r) {
+    if (!l) return r;
+    if (!r) return l;
+    BSTNode* pivot = leftmost(r);
+    BSTNode* rest = pivot->right;
+    BSTNode* node = pivot == r ? nullptr : pivot->parent;
+    while (node) {
+      BSTNode* up = node == r ? nullptr : node->parent;
+      node->left = rest;
+      if (rest) rest->parent = node;
+      rest = balanceNode(node);
+      node = up;
+    }
+    return joinTrees(l, pivot, rest);
+  }
+
+  // Splits the subtree t into keys < key (l) and keys > key (r). A node
+  // holding key itself is detached and returned.
+  BSTNode* splitTree(BSTNode* t, const KeyT& key, BSTNode*& l, BSTNode*& r) {
+    return splitWhere(t, [&](BSTNode* node) { return compareKeys(key, node->key); }, l, r);
+  }
+
+  // Splits the subtree t into the nodes before (l) and after (r) the point
+  // that toward(node) searches for: toward is called once per node on the
+  // way down and says whether that point lies left of node (< 0), right of
+  // it (> 0) or at node itself (== 0), which is then detached and returned.
+  // The search path is retraced through parent pointers rather than
+  // recursion or a stack, so nothing is allocated and degenerate plain trees
+  // do not recurse deeply.
+  template <typename Toward>
+  BSTNode* splitWhere(BSTNode* t, Toward toward, BSTNode*& l, BSTNode*& r) {
+    BSTNode* node = nullptr;  // deepest path node above mid
+    BSTNode* mid = nullptr;
+    bool wentLeft = false;
+    for (BSTNode* current = t; current;) {
+      auto order = toward(current);
+      if (order == 0) {
+        mid = current;
+        break;
+      }
+      node = current;
+      wentLeft = order < 0;
+      current = wentLeft ? current->left : current->right;
+    }
+    l = mid ? mid->left : nullptr;
+    r = mid ? mid->right : nullptr;
+    if (mid) {
+      mid->left = mid->right = mid->parent = nullptr;
+      updateNode(mid);
+    }
+    while (node) {
+      // Read before the join below, which may rotate node away from up.
+      BSTNode* up = node == t ? nullptr : node->parent;
+      bool upWentLeft = up && up->left == node;
+      if (wentLeft) r = joinTrees(r, node, node->right);
+      else l = joinTrees(node->left, node, l);
+      node = up;
+      wentLeft = upWentLeft;
+    }
+    if (l) l->parent = nullptr;
+    if (r) r->parent = nullptr;
+    return mid;
+  }
+
+  // The set operations below split one tree around the root key of the
+  // other, recurse on the two halves and join the results, in
+  // O(m log(n/m + 1)) under AVLBalance. The halves touch disjoint nodes, so
+  // they may run on two threads (forkJoin). Neither half allocates or frees
+  // through alloc, which is not thread-safe: detached subtrees that should
+  // be freed are collected in dropped for the caller to free afterwards.
+
+  // Returns {left(dropped), right(dropped)}, running left on another thread
+  // when parallel is set.
+  template <typename Left, typename Right>
+  static pair<BSTNode*, BSTNode*> forkJoin(bool parallel, vector<BSTNode*>& dropped, Left left, Right right) {
+    if (!parallel) {
+      BSTNode* l = left(dropped);
+      return {l, right(dropped)};
+    }
+    vector<BSTNode*> droppedRight;
+    auto pending = async(launch::async, [&] { return left(dropped); });
+    BSTNode* r = right(droppedRight);
+    BSTNode* l = pending.get();
+    dropped.insert(dropped.end(), droppedRight.begin(), droppedRight.end());
+    return {l, r};
+  }
+
+  static bool splitWorthIt(size_t leftNodes, size_t rightNodes, int spawnDepth) {
+    return spawnDepth > 0 && min(leftNodes, rightNodes) >= ParallelCutoff;
+  }
+
+  // Only a level that forks spends the spawn budget, so splits too small or
+  // lopsided to fork leave it for larger subtrees further down.
+  static int childDepth(bool parallel, int spawnDepth) { return parallel ? spawnDepth - 1 : spawnDepth; }
+
+  // Union of t1 and t2, both owned by this map's allocator. On equal keys
+  // t1's node is kept and t2's is dropped.
+  BSTNode* unionTrees(BSTNode* t1, BSTNode* t2, vector<BSTNode*>& dropped, int spawnDepth) {
+    if (!t1) return t2;
+    if (!t2) return t1;
+    BSTNode* l2 = t2->left;
+    BSTNode* r2 = t2->right;
+    t2->left = t2->right = t2->parent = nullptr;
+    BSTNode *l1, *r1;
+    BSTNode* mid = splitTree(t1, t2->key, l1, r1);
+    bool parallel = splitWorthIt(countOf(l1) + countOf(l2), countOf(r1) + countOf(r2), spawnDepth);
+    int depth = childDepth(parallel, spawnDepth);
+    auto [l, r] = forkJoin(
+        parallel, dropped, [&](vector<BSTNode*>& d) { return unionTrees(l1, l2, d, depth); },
+        [&](vector<BSTNode*>& d) { return unionTrees(r1, r2, d, depth); });
+    if (mid) {
+      dropped.push_back(t2);
+      t2 = mid;
+    }
+    return joinTrees(l, t2, r);
+  }
+
+  // Keeps the nodes of t1 whose keys also appear in t2 (read only).
+  BSTNode* intersectTrees(BSTNode* t1, const BSTNode* t2, vector<BSTNode*>& dropped, int spawnDepth) {
+    if (!t1) return nullptr;
+    if (!t2) {
+      t1->parent = nullptr;
+      dropped.push_back(t1);
+      return nullptr;
+    }
+    BSTNode *l1, *r1;
+    BSTNode* mid = splitTree(t1, t2->key, l1, r1);
+    bool parallel = splitWorthIt(countOf(l1), countOf(r1), spawnDepth);
+    int depth = childDepth(parallel, spawnDepth);
+    auto [l, r] = forkJoin(
+        parallel, dropped, [&](vector<BSTNode*>& d) { return intersectTrees(l1, t2->left, d, depth); },
+        [&](vector<BSTNode*>& d) { return intersectTrees(r1, t2->right, d, depth); });
+    return mid ? joinTrees(l, mid, r) : joinTrees(l, r);
+  }
+
+  // Drops the nodes of t1 whose keys appear in t2 (read only).
+  BSTNode* differenceTrees(BSTNode* t1, const BSTNode* t2, vector<BSTNode*>& dropped, int spawnDepth) {
+    if (!t1 || !t2) return t1;
+    BSTNode *l1, *r1;
+    BSTNode* mid = splitTree(t1, t2->key, l1, r1);
+    if (mid) dropped.push_back(mid);
+    bool parallel = splitWorthIt(countOf(l1), countOf(r1), spawnDepth);
+    int depth = childDepth(parallel, spawnDepth);
+    auto [l, r] = forkJoin(
+        parallel, dropped, [&](vector<BSTNode*>& d) { return differenceTrees(l1, t2->left, d, depth); },
+        [&](vector<BSTNode*>& d) { return differenceTrees(r1, t2->right, d, depth); });
+    return joinTrees(l, r);
+  }
+
+  enum SetOpKind { Union, Intersect, Difference };
+
+  // Relinks tree into a chain through right pointers, in key order. The
+  // walk goes from the largest node down, and predecessor() never reads a
+  // right link of a node that is already on the chain.
+  static BSTNode* chainTree(BSTNode* tree) {
+    BSTNode* head = nullptr;
+    for (BSTNode* node = tree ? rightmost(tree) : nullptr; node;) {
+      BSTNode* prev = predecessor(node);
+      node->right = head;
+      head = node;
+      node = prev;
+    }
+    return head;
+  }
+
+  // The set operations above recurse once per level of the trees, which
+  // only AVLBalance keeps shallow; a plain or splay tree built from sorted
+  // keys would overflow the stack. For those, Kind is done as one merge of
+  // the two key sequences in O(n + m) and the result relinked perfectly
+  // balanced. Union consumes t2; the others only read it.
+  template <SetOpKind Kind>
+  BSTNode* mergeTrees(BSTNode* t1, BSTNode* t2, vector<BSTNode*>& dropped) {
+    BSTNode* a = chainTree(t1);
+    BSTNode* b = Kind == Union ? chainTree(t2) : t2 ? leftmost(t2) : nullptr;
+    auto nextOfB = [](BSTNode* node) { return Kind == Union ? node->right : successor(node); };
+    BSTNode* head = nullptr;
+    BSTNode** tail = &head;
+    size_t n = 0;
+    auto keep = [&](BSTNode* node) {
+      *tail = node;
+      tail = &node->right;
+      n++;
+    };
+    auto drop = [&](BSTNode* node) {
+      node->left = node->right = node->parent = nullptr;
+      dropped.push_back(node);
+    };
+    while (a || (Kind == Union && b)) {
+      auto order = !a ? weak_ordering::greater : !b ? weak_ordering::less : compareKeys(a->key, b->key);
+      BSTNode* nextA = a && order <= 0 ? a->right : a;
+      BSTNode* nextB = b && order >= 0 ? nextOfB(b) : b;
+      if (order < 0) {
+        if (Kind == Intersect) drop(a);
+        else keep(a);
+      } else if (order > 0) {
+        if (Kind == Union) keep(b);
+      } else {
+        if (Kind == Difference) drop(a);
+        else keep(a);
+        if (Kind == Union) drop(b);
+      }
+      a = nextA;
+      b = nextB;
+    }
+    *tail = nullptr;
+    return linkSorted(head, n, nullptr);
+  }
+
+  // Runs one of the set operations above on the whole tree, then frees
+  // what it dropped and recounts.
+  template <typename Op>
+  void applySetOp(Op op) {
+    vector<BSTNode*> dropped;
+    // The counters are plain fields, so a counting map stays on one thread.
+    int spawnDepth = isCounting ? 0 : static_cast<int>(bit_width(thread::hardware_concurrency()));
+    root = op(root, dropped, spawnDepth);
+    if (root) root->parent = nullptr;
+    for (BSTNode* tree : dropped) clearHelper(tree);
+    sz = countOf(root);
+    curr = nullptr;
+    refreshEnds();
+  }
+
+  // Detaches other's tree for linking into this one. Nodes can only change
+  // hands between maps that share an allocator; otherwise the tree is
+  // cloned through this map's allocator and other is cleared.
+  BSTNode* takeTree(BSTMap& other) {
+    BSTNode* tree = other.root;
+    if (alloc == other.alloc) {
+      other.root = other.curr = other.minNode = other.maxNode = nullptr;
+      other.sz = 0;
+    } else {
+      copyHelper(tree, other.root, nullptr);
+      other.clear();
+    }
+    return tree;
+  }
+
+  // Builds n nodes by calling makeNode(), chained through right pointers,
+  // checking that keys strictly increase.
+  template <typename MakeNode>
+  void chainNodes(size_t n, MakeNode makeNode, BSTNode*& head) {
+    head = nullptr;
+    BSTNode* tail = nullptr;
+    try {
+      for (size_t i = 0; i < n; i++) {
+        BSTNode* node = makeNode();
+        if (tail && compareKeys(tail->key, node->key) >= 0) {
+          deleteNode(node);
+          throw invalid_argument("Keys are not sorted and unique");
+        }
+        (tail ? tail->right : head) = node;
+        tail = node;
+      }
+    } catch (...) {
+      while (head) {
+        BSTNode* next = head->right;
+        deleteNode(head);
+        head = next;
+      }
+      throw;
+    }
+  }
+
+  // Chains one node per entry of [first, last). Returns the chain length.
+  template <typename It>
+  size_t chainSorted(It first, It last, BSTNode*& head) {
+    size_t n = distance(first, last);
+    chainNodes(
+        n,
+        [&] {
+          auto&& entry = *first;
+          BSTNode* node = newNode(nullptr, std::forward<decltype(entry)>(entry).first,
+                                  std::forward<decltype(entry)>(entry).second);
+          ++first;
+          return node;
+        },
+        head);
+    return n;
+  }
+
+  // Turns the next n nodes of a right-linked chain into a perfectly
+  // balanced subtree in one in-order pass.
+  BSTNode* linkSorted(BSTNode*& chain, size_t n, BSTNode* parent) {
+    if (n == 0) return nullptr;
+    size_t leftCount = n / 2;
+    BSTNode* left = linkSorted(chain, leftCount, nullptr);
+    BSTNode* node = chain;
+    chain = chain->right;
+    node->parent = parent;
+    node->left = left;
+    if (left) left->parent = node;
+    node->right = linkSorted(chain, n - leftCount - 1, node);
+    updateNode(node);
+    return node;
+  }
+
+  // Hangs a freshly created node under parent (or makes it the root).
+  // Links node below parent on the side the search for its slot found.
+  void attachNode(BSTNode* node, BSTNode* parent, bool left) {
+    if (!parent) root = minNode = maxNode = node;
+    else if (left) parent->left = node;
+    else parent->right = node;
+    if (parent == minNode && parent->left == node) minNode = node;
+    if (parent == maxNode && parent->right == node) maxNode = node;
+    sz++;
+    if constexpr (isSplay) splay(node);
+    else rebalance(parent);
+  }
+
+  // Takes node out of the tree without freeing it and returns the node
+  // holding the entry after it. A node with two children is replaced by
+  // its in-order successor, which is relinked into node's place, so no
+  // payload moves and every other node keeps its entry.
+  BSTNode* detachNode(BSTNode* node) {
+    BSTNode* next = successor(node);
+    if (node == minNode) minNode = next;
+    if (node == maxNode) maxNode = predecessor(node);
+    BSTNode* changed;  // lowest node whose subtree lost a node
+    if (node->left && node->right) {
+      if (next == node->right) {
+        changed = next;
+      } else {
+        changed = next->parent;
+        changed->left = next->right;
+        if (next->right) next->right->parent = changed;
+        next->right = node->right;
+        next->right->parent = next;
+      }
+      next->left = node->left;
+      next->left->parent = next;
+      replaceChild(node->parent, node, next);
+    } else {
+      changed = node->parent;
+      replaceChild(node->parent, node, node->left ? node->left : node->right);
+    }
+    node->parent = node->left = node->right = nullptr;
+    sz--;
+    rebalance(changed);
+    return next;
+  }
+
+  // Removes node's entry and returns the node holding the entry after it.
+  BSTNode* eraseNode(BSTNode* node) {
+    BSTNode* next = detachNode(node);
+    deleteNode(node);
+    return next;
+  }
+
+  // Returns the node for key, new or existing.
+  template <typename K, typename V>
+  BSTNode* insertNear(BSTNode* hint, K&& key, V&& value) {
+    BSTNode* start = hint ? hint : maxNode;
+    BSTNode* parent;
+    bool left;
+    BSTNode* found = start ? findNear(start, key, parent, left, Insert) : findSlot(key, parent, left);
+    if (found) return found;
+    BSTNode* node = newNode(parent, std::forward<K>(key), std::forward<V>(value));
+    attachNode(node, parent, left);
+    return node;
+  }
+
+  BSTNode* findNearNode(BSTNode* near, const KeyT& key) const {
+    BSTNode* start = near ? near : maxNode;
+    if (!start) return nullptr;
+    BSTNode* parent;
+    bool left;
+    return findNear(start, key, parent, left, Lookup);
+  }
+
+  // Unlinks minNode or maxNode and returns its entry. The node is found in
+  // O(1), but unlinking it still fixes subtree counts all the way to the
+  // root, so this is O(height).
+  pair<KeyT, ValT> removeEnd(BSTNode* node) {
+    pair<KeyT, ValT> result = {std::move(const_cast<KeyT&>(node->key)), std::move(node->value)};
+    eraseNode(node);
+    return result;
+  }
+
+  // Frees the n smallest nodes, n <= sz. They are split off by rank, not
+  // by key, so their keys may already have been moved from.
+  void dropSmallest(size_t n) {
+    if (n == 0) return;
+    if (n == sz) {
+      clear();
       return;
     }
-    node = new BSTNode(otherNode->key, otherNode->value, parent);
-    copyHelper(node->left, otherNode->left, node);
-    copyHelper(node->right, otherNode->right, node);
+    BSTNode *l, *r;
+    BSTNode* first = splitWhere(
+        root,
+        [&](BSTNode* node) {
+          size_t leftCount = countOf(node->left);
+          if (n < leftCount) return weak_ordering::less;
+          if (n == leftCount) return weak_ordering::equivalent;
+          n -= leftCount + 1;
+          return weak_ordering::greater;
+        },
+        l, r);
+    sz -= countOf(l);
+    clearHelper(l);
+    root = joinTrees(nullptr, first, r);
+    root->parent = nullptr;
+    minNode = first;
+    curr = nullptr;
   }
 
-  void toStringHelper(BSTNode* node, ostringstream& ss) const {
-    if (!node) return;
-    toStringHelper(node->left, ss);
-    ss << node->key << ": " << node->value << endl;
-    toStringHelper(node->right, ss);
+  // First node whose key is not less than key (or greater than key when
+  // strict is set), or nullptr.
+  template <typename K>
+  BSTNode* boundNode(const K& key, bool strict) const {
+    BSTNode* current = root;
+    BSTNode* bound = nullptr;
+    while (current) {
+      auto order = compareKeys(current->key, key);
+      if (strict ? order > 0 : order >= 0) {
+        bound = current;
+        current = current->left;
+      } else {
+        current = current->right;
+      }
+    }
+    return bound;
   }
 
+  BSTNode* selectNode(size_t k) const {
+    BSTNode* current = root;
+    while (current) {
+      size_t leftCount = countOf(current->left);
+      if (k == leftCount) return current;
+      if (k < leftCount) {
+        current = current->left;
+      } else {
+        k -= leftCount + 1;
+        current = current->right;
+      }
+    }
+    return nullptr;
+  }
+
+  template <typename It>
+  static constexpr bool isForwardIterator =
+      derived_from<typename iterator_traits<It>::iterator_category, forward_iterator_tag>;
+
  public:
+  // Bidirectional in-order iterator. Entries are stored as separate key and
+  // value members, so dereferencing yields a pair of references rather than
+  // a reference to a stored pair; structured bindings work either way.
+  template <bool Const>
+  class Iterator {
+    friend class BSTMap;
+
+    BSTNode* node;
+    const BSTMap* tree;
+
+    Iterator(BSTNode* node, const BSTMap* tree) : node(node), tree(tree) {}
+
+   public:
+    using iterator_category = bidirectional_iterator_tag;
+    using value_type = pair<const KeyT, ValT>;
+    using difference_type = ptrdiff_t;
+    using reference = pair<const KeyT&, conditional_t<Const, const ValT&, ValT&>>;
+
+    struct pointer {
+      reference ref;
+      const reference* operator->() const { return &ref; }
+    };
+
+    Iterator() : node(nullptr), tree(nullptr) {}
+
+    template <bool WasConst>
+      requires(Const && !WasConst)
+    Iterator(const Iterator<WasConst>& other) : node(other.node), tree(other.tree) {}
+
+    reference operator*() const { return {node->key, node->value}; }
+    pointer operator->() const { return {**this}; }
+
+    const KeyT& key() const { return node->key; }
+    conditional_t<Const, const ValT&, ValT&> value() const { return node->value; }
+
+    Iterator& operator++() {
+      node = successor(node);
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    // Decrementing end() lands on the largest key.
+    Iterator& operator--() {
+      node = node ? predecessor(node) : tree->maxNode;
+      return *this;
+    }
+
+    Iterator operator--(int) {
+      Iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    friend bool operator==(const Iterator& a, const Iterator& b) { return a.node == b.node; }
+  };
+
+  using key_type = KeyT;
+  using mapped_type = ValT;
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  // Owns one entry taken out of a map by extract(), along with a copy of
+  // the allocator that made its node, until the entry is inserted into a
+  // map or the handle is destroyed. Moving a handle never touches the entry.
+  // GCC 12 reports moving the disengaged optional allocator as a read of
+  // uninitialized memory (GCC bug 80635); the warning is silenced for this
+  // class only.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+  class node_type {
+    friend class BSTMap;
+
+    BSTNode* node = nullptr;
+    optional<NodeAlloc> alloc;  // set while a node is held
+
+    node_type(BSTNode* node, const NodeAlloc& alloc) : node(node), alloc(alloc) {}
+
+    BSTNode* release() {
+      alloc.reset();
+      return exchange(node, nullptr);
+    }
+
+    void reset() {
+      if (node) {
+        NodeTraits::destroy(*alloc, node);
+        NodeTraits::deallocate(*alloc, node, 1);
+      }
+      release();
+    }
+
+   public:
+    node_type() = default;
+
+    node_type(node_type&& other) noexcept : node(other.node), alloc(std::move(other.alloc)) { other.release(); }
+
+    node_type& operator=(node_type&& other) noexcept {
+      if (this != &other) {
+        reset();
+        node = other.node;
+        alloc = std::move(other.alloc);
+        other.release();
+      }
+      return *this;
+    }
+
+    ~node_type() { reset(); }
+
+    bool empty() const { return node == nullptr; }
+    explicit operator bool() const { return node != nullptr; }
+
+    const KeyT& key() const { return node->key; }
+    ValT& mapped() const { return node->value; }
+    Alloc get_allocator() const { return Alloc(*alloc); }
+  };
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#pragma GCC diagnostic pop
+#endif
+
+  // What insert(node_type&&) reports: the entry for the key, whether the
+  // handle's entry was added and, if not, the handle with the entry still in it.
+  struct insert_return_type {
+    iterator position;
+    bool inserted;
+    node_type node;
+  };
+
   BSTMap() : root(nullptr), sz(0), curr(nullptr) {}
 
+  explicit BSTMap(const Alloc& a) : root(nullptr), sz(0), curr(nullptr), alloc(a) {}
+
+  explicit BSTMap(const Compare& c, const Alloc& a = Alloc()) : root(nullptr), sz(0), curr(nullptr), alloc(a), comp(c) {}
+
+  // Builds a balanced map in O(n) from entries already sorted by strictly
+  // increasing key. Throws invalid_argument if the order is violated.
+  template <typename It>
+    requires isForwardIterator<It>
+  BSTMap(It first, It last, const Alloc& a = Alloc()) : BSTMap(a) {
+    assign_sorted(first, last);
+  }
+
+  Alloc get_allocator() const { return Alloc(alloc); }
+
+  Compare key_comp() const { return comp; }
+
   bool empty() const { return sz == 0; }
 
   size_t size() const { return sz; }
 
-  void insert(KeyT key, ValT value) {
-    if (!root) {
-      root = new BSTNode(key, value, nullptr);
-      sz = 1;
-      return;
+  // Number of nodes on the longest root-to-leaf path (0 when empty).
+  size_t height() const {
+    if constexpr (isAVL) return heightOf(root);
+    size_t best = 0;
+    visitPreorder([&](BSTNode*, size_t depth) { best = max(best, depth); });
+    return best;
+  }
+
+  // Operation counters since construction or reset_stats(), plus the shape
+  // of the tree, which takes an O(n) walk.
+  BSTMapStats stats() const {
+    BSTMapStats result;
+    if constexpr (isCounting) {
+      result.comparisons = counters.comparisons;
+      result.lookups = counters.searches[Lookup];
+      result.lookup_visits = counters.visits[Lookup];
+      result.inserts = counters.searches[Insert];
+      result.insert_visits = counters.visits[Insert];
+      result.erases = counters.searches[Erase];
+      result.erase_visits = counters.visits[Erase];
+      result.allocations = counters.allocations;
+      result.frees = counters.frees;
     }
+    size_t pathNodes = 0;
+    visitPreorder([&](BSTNode*, size_t depth) {
+      if (result.depth_histogram.size() < depth) result.depth_histogram.resize(depth);
+      result.depth_histogram[depth - 1]++;
+      pathNodes += depth;
+    });
+    result.size = sz;
+    result.height = result.depth_histogram.size();
+    if (sz > 0) result.average_path_length = double(pathNodes) / sz;
+    return result;
+  }
 
-    BSTNode* current = root;
-    BSTNode* parent = nullptr;
+  void reset_stats() { counters = {}; }
 
-    while (current) {
-      parent = current;
-      if (key == current->key) return;
-      else if (key < current->key) current = current->left;
-      else current = current->right;
+  // Adds key unless it is already present. Each argument is copied or moved
+  // as passed, so insert(key, std::move(value)) moves the value even though
+  // key is copied.
+  template <typename K = KeyT, typename V = ValT>
+    requires convertible_to<K, KeyT> && convertible_to<V, ValT>
+  void insert(K&& key, V&& value) {
+    try_emplace(std::forward<K>(key), std::forward<V>(value));
+  }
+
+  // Builds the value in place from args only if key is absent. Returns the
+  // entry for key and whether it was added.
+  template <typename... Args>
+  pair<iterator, bool> try_emplace(const KeyT& key, Args&&... args) {
+    BSTNode* parent;
+    bool left;
+    if (BSTNode* found = findSlot(key, parent, left)) return {iterator(found, this), false};
+    BSTNode* node = newNode(parent, key, std::forward<Args>(args)...);
+    attachNode(node, parent, left);
+    return {iterator(node, this), true};
+  }
+
+  template <typename... Args>
+  pair<iterator, bool> try_emplace(KeyT&& key, Args&&... args) {
+    BSTNode* parent;
+    bool left;
+    if (BSTNode* found = findSlot(key, parent, left)) return {iterator(found, this), false};
+    BSTNode* node = newNode(parent, std::move(key), std::forward<Args>(args)...);
+    attachNode(node, parent, left);
+    return {iterator(node, this), true};
+  }
+
+  // Inserts key unless it is already present, searching from hint instead
+  // of the root (from the largest entry if hint is end()). Returns the
+  // entry for key. For a key about d entries from the hint the search makes
+  // O(log d) comparisons on average rather than O(log n), so passing each
+  // result back as the next hint helps most when comparisons are costly.
+  // Only the search gets cheaper: linking the node in still updates the
+  // subtree counts (and AVL heights) of every ancestor, so each insert
+  // remains O(height).
+  template <typename K = KeyT, typename V = ValT>
+    requires convertible_to<K, KeyT> && convertible_to<V, ValT>
+  iterator insert(const_iterator hint, K&& key, V&& value) {
+    if constexpr (!is_same_v<remove_cvref_t<K>, KeyT>) {
+      return insert(hint, KeyT(std::forward<K>(key)), std::forward<V>(value));  // convert once
+    } else {
+      return iterator(insertNear(hint.node, std::forward<K>(key), std::forward<V>(value)), this);
     }
+  }
 
-    BSTNode* newNode = new BSTNode(key, value, parent);
-    if (key < parent->key) parent->left = newNode;
-    else parent->right = newNode;
-    sz++;
+  // Builds a node from (key, value args...) and links it in unless the key
+  // is already present, in which case the node is discarded.
+  template <typename... Args>
+  pair<iterator, bool> emplace(Args&&... args) {
+    BSTNode* node = newNode(nullptr, std::forward<Args>(args)...);
+    BSTNode* parent;
+    bool left;
+    if (BSTNode* found = findSlot(node->key, parent, left)) {
+      deleteNode(node);
+      return {iterator(found, this), false};
+    }
+    node->parent = parent;
+    attachNode(node, parent, left);
+    return {iterator(node, this), true};
   }
 
   ValT& at(const KeyT& key) const {
@@ -96,165 +1360,649 @@ class BSTMap {
     return node->value;
   }
 
+  template <typename K>
+    requires isTransparent
+  ValT& at(const K& key) const {
+    BSTNode* node = findNode(key);
+    if (!node) throw out_of_range("Key not found");
+    return node->value;
+  }
+
   bool contains(const KeyT& key) const { return findNode(key) != nullptr; }
 
+  template <typename K>
+    requires isTransparent
+  bool contains(const K& key) const {
+    return findNode(key) != nullptr;
+  }
+
+  // Immutable copy of the current entries laid out for fast lookups, in the
+  // same key order as this map.
+  FrozenMap<KeyT, ValT, FrozenCompare> freeze() const {
+    if constexpr (is_same_v<FrozenCompare, FrozenLess>) return {cbegin(), cend(), FrozenLess{comp}};
+    else if constexpr (is_same_v<FrozenCompare, Compare>) return {cbegin(), cend(), comp};
+    else return {cbegin(), cend()};
+  }
+
+  // Number of keys strictly less than key, in O(height).
+  size_t rank(const KeyT& key) const {
+    size_t less = 0;
+    BSTNode* current = root;
+    while (current) {
+      if (compareKeys(current->key, key) < 0) {
+        less += countOf(current->left) + 1;
+        current = current->right;
+      } else {
+        current = current->left;
+      }
+    }
+    return less;
+  }
+
+  // The entry with exactly k smaller keys, or end() if k >= size().
+  iterator select(size_t k) { return iterator(selectNode(k), this); }
+  const_iterator select(size_t k) const { return const_iterator(selectNode(k), this); }
+
+  // The k-th smallest key, counting from 0.
+  const KeyT& kth(size_t k) const {
+    BSTNode* node = selectNode(k);
+    if (!node) throw out_of_range("Rank out of range");
+    return node->key;
+  }
+
+  // Number of keys in [lo, hi).
+  size_t count_range(const KeyT& lo, const KeyT& hi) const {
+    if (compareKeys(lo, hi) >= 0) return 0;
+    return rank(hi) - rank(lo);
+  }
+
+  iterator lower_bound(const KeyT& key) { return iterator(boundNode(key, false), this); }
+  const_iterator lower_bound(const KeyT& key) const { return const_iterator(boundNode(key, false), this); }
+
+  iterator upper_bound(const KeyT& key) { return iterator(boundNode(key, true), this); }
+  const_iterator upper_bound(const KeyT& key) const { return const_iterator(boundNode(key, true), this); }
+
+  template <typename K>
+    requires isTransparent
+  iterator lower_bound(const K& key) {
+    return iterator(boundNode(key, false), this);
+  }
+
+  template <typename K>
+    requires isTransparent
+  const_iterator lower_bound(const K& key) const {
+    return const_iterator(boundNode(key, false), this);
+  }
+
+  template <typename K>
+    requires isTransparent
+  iterator upper_bound(const K& key) {
+    return iterator(boundNode(key, true), this);
+  }
+
+  template <typename K>
+    requires isTransparent
+  const_iterator upper_bound(const K& key) const {
+    return const_iterator(boundNode(key, true), this);
+  }
+
+  pair<iterator, iterator> equal_range(const KeyT& key) {
+    iterator first = lower_bound(key);
+    iterator last = first;
+    if (last != end() && compareKeys(key, last->first) >= 0) ++last;
+    return {first, last};
+  }
+
+  pair<const_iterator, const_iterator> equal_range(const KeyT& key) const {
+    const_iterator first = lower_bound(key);
+    const_iterator last = first;
+    if (last != end() && compareKeys(key, last->first) >= 0) ++last;
+    return {first, last};
+  }
+
+  // Calls fn(key, value) for every entry with key in [lo, hi), in order.
+  template <typename Fn>
+  void for_each_in_range(const KeyT& lo, const KeyT& hi, Fn fn) {
+    for (BSTNode* node = boundNode(lo, false); node && compareKeys(node->key, hi) < 0; node = successor(node)) {
+      fn(node->key, node->value);
+    }
+  }
+
+  template <typename Fn>
+  void for_each_in_range(const KeyT& lo, const KeyT& hi, Fn fn) const {
+    for (BSTNode* node = boundNode(lo, false); node && compareKeys(node->key, hi) < 0; node = successor(node)) {
+      fn(node->key, as_const(node->value));
+    }
+  }
+
+  // Removes every entry with key in [lo, hi) and returns how many there
+  // were. The range is cut out with two splits and one join, then freed as
+  // a whole subtree, so the cost is O(height + removed).
+  size_t erase_range(const KeyT& lo, const KeyT& hi) {
+    if (!root || compareKeys(lo, hi) >= 0) return 0;
+    BSTNode *below, *from, *inside, *above;
+    BSTNode* first = splitTree(root, lo, below, from);
+    BSTNode* last = splitTree(from, hi, inside, above);
+    root = last ? joinTrees(below, last, above) : joinTrees(below, above);
+    if (root) root->parent = nullptr;
+
+    size_t removed = countOf(inside) + (first ? 1 : 0);
+    clearHelper(inside);
+    if (first) deleteNode(first);
+    sz -= removed;
+    refreshEnds();
+    return removed;
+  }
+
+  // Moves every entry with key not less than key into the returned map,
+  // which shares this map's allocator. Nodes are relinked, not copied, in
+  // O(height) under AVLBalance.
+  BSTMap split(const KeyT& key) {
+    BSTMap upper(comp, get_allocator());
+    BSTNode *l, *r;
+    BSTNode* mid = splitTree(root, key, l, r);
+    if (mid) r = joinTrees(nullptr, mid, r);
+    root = l;
+    if (root) root->parent = nullptr;
+    sz = countOf(root);
+    curr = nullptr;
+    refreshEnds();
+    upper.root = r;
+    if (r) r->parent = nullptr;
+    upper.sz = countOf(r);
+    upper.refreshEnds();
+    return upper;
+  }
+
+  // Concatenates two maps where every key of left is less than every key
+  // of right; throws invalid_argument otherwise. O(height) when the
+  // allocators are equal, since the nodes are then relinked, not copied.
+  static BSTMap join(BSTMap&& left, BSTMap&& right) {
+    if (!left.empty() && !right.empty() && left.compareKeys(left.maxNode->key, right.minNode->key) >= 0) {
+      throw invalid_argument("Key ranges overlap");
+    }
+    BSTMap joined(std::move(left));
+    BSTNode* tail = joined.takeTree(right);
+    joined.root = joined.joinTrees(joined.root, tail);
+    if (joined.root) joined.root->parent = nullptr;
+    joined.sz = countOf(joined.root);
+    joined.refreshEnds();
+    return joined;
+  }
+
+  // Adds every entry of other whose key is not already present. other's
+  // nodes are relinked when the allocators are equal and cloned otherwise;
+  // either way other ends up empty.
+  void union_with(BSTMap&& other) {
+    BSTNode* tree = takeTree(other);
+    applySetOp([&](BSTNode* t, vector<BSTNode*>& dropped, int spawnDepth) {
+      if constexpr (isAVL) return unionTrees(t, tree, dropped, spawnDepth);
+      else return mergeTrees<Union>(t, tree, dropped);
+    });
+  }
+
+  void union_with(const BSTMap& other) {
+    BSTNode* tree;
+    copyHelper(tree, other.root, nullptr);
+    applySetOp([&](BSTNode* t, vector<BSTNode*>& dropped, int spawnDepth) {
+      if constexpr (isAVL) return unionTrees(t, tree, dropped, spawnDepth);
+      else return mergeTrees<Union>(t, tree, dropped);
+    });
+  }
+
+  // Removes every entry whose key is not in other.
+  void intersect_with(const BSTMap& other) {
+    if (&other == this) return;
+    applySetOp([&](BSTNode* t, vector<BSTNode*>& dropped, int spawnDepth) {
+      if constexpr (isAVL) return intersectTrees(t, other.root, dropped, spawnDepth);
+      else return mergeTrees<Intersect>(t, other.root, dropped);
+    });
+  }
+
+  // Removes every entry whose key is in other.
+  void difference_with(const BSTMap& other) {
+    if (&other == this) return clear();
+    applySetOp([&](BSTNode* t, vector<BSTNode*>& dropped, int spawnDepth) {
+      if constexpr (isAVL) return differenceTrees(t, other.root, dropped, spawnDepth);
+      else return mergeTrees<Difference>(t, other.root, dropped);
+    });
+  }
+
+  iterator find(const KeyT& key) { return iterator(findNode(key), this); }
+  const_iterator find(const KeyT& key) const { return const_iterator(findNode(key), this); }
+
+  // find() by finger search from near (from the largest entry if near is
+  // end()); takes O(log d) comparisons on average for a key about d
+  // entries from near.
+  iterator find_near(const_iterator near, const KeyT& key) { return iterator(findNearNode(near.node, key), this); }
+
+  const_iterator find_near(const_iterator near, const KeyT& key) const {
+    return const_iterator(findNearNode(near.node, key), this);
+  }
+
+  // Sets out[i] to the value stored for keys[i], or nullptr. Much faster
+  // than calling at() in a loop on trees that do not fit in cache, since
+  // many searches wait on memory at the same time (see findGroup).
+  void find_batch(span<const KeyT> keys, span<ValT*> out) const {
+    if (out.size() < keys.size()) throw invalid_argument("Output span is shorter than keys");
+    BSTNode* found[BatchWidth];
+    for (size_t base = 0; base < keys.size(); base += BatchWidth) {
+      size_t n = min(BatchWidth, keys.size() - base);
+      findGroup(keys.data() + base, n, found);
+      for (size_t i = 0; i < n; i++) out[base + i] = found[i] ? &found[i]->value : nullptr;
+    }
+  }
+
+  // Inserts keys[i] -> values[i] for every key not yet present and returns
+  // how many were added. Each group is first searched side by side, which
+  // skips keys already present and pulls the search paths into cache; the
+  // inserts themselves still run one by one, as each may rebalance the tree.
+  size_t insert_batch(span<const KeyT> keys, span<const ValT> values) {
+    if (values.size() < keys.size()) throw invalid_argument("Value span is shorter than keys");
+    BSTNode* found[BatchWidth];
+    size_t added = 0;
+    for (size_t base = 0; base < keys.size(); base += BatchWidth) {
+      size_t n = min(BatchWidth, keys.size() - base);
+      findGroup(keys.data() + base, n, found);
+      for (size_t i = 0; i < n; i++) {
+        if (!found[i] && try_emplace(keys[base + i], values[base + i]).second) added++;
+      }
+    }
+    return added;
+  }
+
+  template <typename K>
+    requires isTransparent
+  iterator find(const K& key) {
+    return iterator(findNode(key), this);
+  }
+
+  template <typename K>
+    requires isTransparent
+  const_iterator find(const K& key) const {
+    return const_iterator(findNode(key), this);
+  }
+
   void clear() {
-    clearHelper(root);
-    root = nullptr;
+    if (root && canReleasePool()) {
+      if constexpr (!is_trivially_destructible_v<BSTNode>) clearHelper(root, true);
+      else if constexpr (isCounting) counters.frees += sz;
+      if constexpr (requires(NodeAlloc& a) { a.release(); }) alloc.release();
+    } else {
+      clearHelper(root);
+    }
+    root = minNode = maxNode = nullptr;
     sz = 0;
   }
 
   ~BSTMap() { clear(); }
 
+  // Replaces the contents with [first, last), which must be sorted by
+  // strictly increasing key, in O(n). On failure the map is left empty.
+  template <typename It>
+    requires isForwardIterator<It>
+  void assign_sorted(It first, It last) {
+    clear();
+    BSTNode* chain;
+    size_t n = chainSorted(first, last, chain);
+    root = linkSorted(chain, n, nullptr);
+    sz = n;
+    refreshEnds();
+  }
+
+  // Writes the entries to path in key order, in a binary format that only
+  // load() on a map with the same key and value types reads back. Entries
+  // go through MapCodec, or are dumped as two flat arrays when both types
+  // are trivially copyable.
+  void save(const string& path) const {
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file) throw runtime_error("Cannot open " + path);
+    MapFileHeader header{};
+    memcpy(header.magic, MapFileHeader::Magic, sizeof(header.magic));
+    header.layout = isRawFile ? MapFileHeader::Raw : MapFileHeader::Encoded;
+    header.keySize = isRawFile ? sizeof(KeyT) : 0;
+    header.valSize = isRawFile ? sizeof(ValT) : 0;
+    header.count = sz;
+    BSTNode* first = minNode;
+    string buffer(MapFileHeader::DataOffset, '\0');
+    memcpy(buffer.data(), &header, sizeof(header));
+    auto flushAt = [&](size_t limit) {
+      if (buffer.size() < limit) return;
+      file.write(buffer.data(), buffer.size());
+      buffer.clear();
+    };
+    if constexpr (isRawFile) {
+      for (BSTNode* node = first; node; node = successor(node)) {
+        MapCodec<KeyT>::encode(buffer, node->key);
+        flushAt(1 << 16);
+      }
+      buffer.resize(buffer.size() + (MapFileHeader::DataOffset - sz * sizeof(KeyT) % MapFileHeader::DataOffset) %
+                                        MapFileHeader::DataOffset);
+      for (BSTNode* node = first; node; node = successor(node)) {
+        MapCodec<ValT>::encode(buffer, node->value);
+        flushAt(1 << 16);
+      }
+    } else {
+      for (BSTNode* node = first; node; node = successor(node)) {
+        MapCodec<KeyT>::encode(buffer, node->key);
+        MapCodec<ValT>::encode(buffer, node->value);
+        flushAt(1 << 16);
+      }
+    }
+    flushAt(0);
+    if (!file.flush()) throw runtime_error("Cannot write " + path);
+  }
+
+  // Replaces the contents with a file written by save(), mapping it into
+  // memory and building the balanced tree in O(n) without per-entry
+  // searches. Throws runtime_error if the file is unreadable, truncated or
+  // was written for other types, and invalid_argument if its keys are out
+  // of order; on failure the map is left empty.
+  void load(const string& path) {
+    clear();
+    MappedFile file(path);
+    MapFileHeader header;
+    if (file.size() < MapFileHeader::DataOffset) throw runtime_error("Not a map file: " + path);
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MapFileHeader::Magic, sizeof(header.magic)) != 0) {
+      throw runtime_error("Not a map file: " + path);
+    }
+    if (header.layout != (isRawFile ? MapFileHeader::Raw : MapFileHeader::Encoded) ||
+        header.keySize != (isRawFile ? sizeof(KeyT) : 0) || header.valSize != (isRawFile ? sizeof(ValT) : 0)) {
+      throw runtime_error("Map file has other key or value types: " + path);
+    }
+    const char* p = file.data() + MapFileHeader::DataOffset;
+    const char* end = file.data() + file.size();
+    size_t n = header.count;
+    BSTNode* chain;
+    if constexpr (isRawFile) {
+      size_t keyBytes = (n * sizeof(KeyT) + MapFileHeader::DataOffset - 1) / MapFileHeader::DataOffset *
+                        MapFileHeader::DataOffset;
+      if (n > static_cast<size_t>(end - p) / (sizeof(KeyT) + sizeof(ValT)) ||
+          keyBytes + n * sizeof(ValT) > static_cast<size_t>(end - p)) {
+        throw runtime_error("Truncated map file");
+      }
+      const KeyT* keys = reinterpret_cast<const KeyT*>(p);
+      const ValT* values = reinterpret_cast<const ValT*>(p + keyBytes);
+      size_t i = 0;
+      chainNodes(
+          n,
+          [&] {
+            BSTNode* node = newNode(nullptr, keys[i], values[i]);
+            i++;
+            return node;
+          },
+          chain);
+    } else {
+      chainNodes(
+          n,
+          [&] {
+            KeyT key = MapCodec<KeyT>::decode(p, end);
+            ValT value = MapCodec<ValT>::decode(p, end);
+            return newNode(nullptr, std::move(key), std::move(value));
+          },
+          chain);
+    }
+    root = linkSorted(chain, n, nullptr);
+    sz = n;
+    refreshEnds();
+  }
+
+  // Streams "key: value" lines in key order, as to_string() formats them,
+  // through a buffer that is written out every 64 KiB. Numbers and strings
+  // skip the stream's formatting when os has default flags, precision and
+  // locale.
+  ostream& write_to(ostream& os) const {
+    bool plain = os.flags() == (ios::dec | ios::skipws) && os.precision() == 6 && os.width() == 0 &&
+                 os.getloc() == locale::classic();
+    string buffer;
+    buffer.reserve(1 << 16);
+    for (BSTNode* node = minNode; node; node = successor(node)) {
+      writeText(os, buffer, plain, node->key);
+      buffer += ": ";
+      writeText(os, buffer, plain, node->value);
+      buffer += '\n';
+      if (buffer.size() >= (1 << 16) - 128) {
+        os.write(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+    }
+    return os.write(buffer.data(), buffer.size());
+  }
+
+  friend ostream& operator<<(ostream& os, const BSTMap& map) { return map.write_to(os); }
+
   string to_string() const {
     ostringstream ss;
-    toStringHelper(root, ss);
+    write_to(ss);
     return ss.str();
   }
 
-  BSTMap(const BSTMap& other) : root(nullptr), sz(0), curr(nullptr) {
+  BSTMap(const BSTMap& other)
+      : root(nullptr),
+        sz(0),
+        curr(nullptr),
+        alloc(NodeTraits::select_on_container_copy_construction(other.alloc)),
+        comp(other.comp) {
     copyHelper(root, other.root, nullptr);
     sz = other.sz;
+    refreshEnds();
   }
 
   BSTMap& operator=(const BSTMap& other) {
     if (this == &other) return *this;
     clear();
+    comp = other.comp;
     copyHelper(root, other.root, nullptr);
     sz = other.sz;
+    refreshEnds();
     return *this;
   }
 
+  BSTMap(BSTMap&& other) noexcept
+      : root(other.root),
+        sz(other.sz),
+        curr(other.curr),
+        minNode(other.minNode),
+        maxNode(other.maxNode),
+        alloc(std::move(other.alloc)),
+        comp(other.comp) {
+    other.root = other.curr = other.minNode = other.maxNode = nullptr;
+    other.sz = 0;
+  }
+
+  BSTMap& operator=(BSTMap&& other) noexcept(
+      NodeTraits::propagate_on_container_move_assignment::value ||
+      NodeTraits::is_always_equal::value) {
+    if (this == &other) return *this;
+    clear();
+    comp = other.comp;
+    if constexpr (NodeTraits::propagate_on_container_move_assignment::value) {
+      alloc = std::move(other.alloc);
+    } else if (!(alloc == other.alloc)) {
+      // Nodes cannot change allocators, so move the payloads one by one.
+      while (!other.empty()) {
+        auto entry = other.remove_min();
+        try_emplace(std::move(entry.first), std::move(entry.second));
+      }
+      return *this;
+    }
+    root = other.root;
+    sz = other.sz;
+    curr = other.curr;
+    minNode = other.minNode;
+    maxNode = other.maxNode;
+    other.root = other.curr = other.minNode = other.maxNode = nullptr;
+    other.sz = 0;
+    return *this;
+  }
+
+  void swap(BSTMap& other) noexcept {
+    using std::swap;
+    swap(root, other.root);
+    swap(sz, other.sz);
+    swap(curr, other.curr);
+    swap(minNode, other.minNode);
+    swap(maxNode, other.maxNode);
+    swap(comp, other.comp);
+    if constexpr (NodeTraits::propagate_on_container_swap::value) swap(alloc, other.alloc);
+  }
+
+  // Remove and return the smallest or largest entry. The entry is reached
+  // through the cached end, but every ancestor's subtree count still has
+  // to drop by one, so each call costs O(height), not O(1). Use
+  // pop_min_batch to drain many entries at amortized O(1) each.
   pair<KeyT, ValT> remove_min() {
     if (!root) throw runtime_error("Tree is empty");
+    return removeEnd(minNode);
+  }
 
-    BSTNode* current = root;
-    BSTNode* parent = nullptr;
+  pair<KeyT, ValT> remove_max() {
+    if (!root) throw runtime_error("Tree is empty");
+    return removeEnd(maxNode);
+  }
 
-    while (current->left) {
-      parent = current;
-      current = current->left;
-    }
+  // The smallest and largest entries, in O(1). Throw runtime_error when
+  // the map is empty, like remove_min.
+  pair<const KeyT&, ValT&> peek_min() {
+    if (!root) throw runtime_error("Tree is empty");
+    return {minNode->key, minNode->value};
+  }
 
-    pair<KeyT, ValT> result = {current->key, current->value};
+  pair<const KeyT&, const ValT&> peek_min() const {
+    if (!root) throw runtime_error("Tree is empty");
+    return {minNode->key, minNode->value};
+  }
 
-    if (!parent) {
-      root = current->right;
-      if (root) root->parent = nullptr;
-    } else if (current->right) {
-      parent->left = current->right;
-      current->right->parent = parent;
-    } else {
-      parent->left = nullptr;
-    }
+  pair<const KeyT&, ValT&> peek_max() {
+    if (!root) throw runtime_error("Tree is empty");
+    return {maxNode->key, maxNode->value};
+  }
 
-    delete current;
-    sz--;
-    return result;
+  pair<const KeyT&, const ValT&> peek_max() const {
+    if (!root) throw runtime_error("Tree is empty");
+    return {maxNode->key, maxNode->value};
+  }
+
+  // Moves the min(k, size()) smallest entries to out, in key order, as
+  // pair<KeyT, ValT> values and returns how many there were. The entries
+  // are read off in one in-order walk and then cut away with a single
+  // split by rank, so draining k entries costs O(k + height) rather than k
+  // separate removals. If writing to out throws, the entries written so far
+  // and the one being written are gone; the rest stay in the map.
+  template <typename OutIt>
+  size_t pop_min_batch(size_t k, OutIt out) {
+    k = min(k, sz);
+    size_t taken = 0;
+    try {
+      for (BSTNode* node = minNode; taken < k; node = successor(node)) {
+        taken++;
+        *out = pair<KeyT, ValT>(std::move(const_cast<KeyT&>(node->key)), std::move(node->value));
+        ++out;
+      }
+    } catch (...) {
+      dropSmallest(taken);
+      throw;
+    }
+    dropSmallest(k);
+    return k;
   }
 
+  // Both trees are walked in lock-step through parent pointers; nothing is
+  // copied or allocated.
   bool operator==(const BSTMap& other) const {
     if (sz != other.sz) return false;
-    if (!root && !other.root) return true;
-
-    BSTMap this_copy(*this);
-    BSTMap other_copy(other);
-
-    this_copy.begin();
-    other_copy.begin();
+    BSTNode* a = minNode;
+    BSTNode* b = other.minNode;
+    for (; a; a = successor(a), b = successor(b)) {
+      if (a->key != b->key || a->value != b->value) return false;
+    }
+    return true;
+  }
 
-    KeyT key1, key2;
-    ValT val1, val2;
-    while (true) {
-      bool has_next1 = this_copy.next(key1, val1);
-      bool has_next2 = other_copy.next(key2, val2);
-      if (has_next1 != has_next2) return false;
-      if (!has_next1 && !has_next2) return true;
-      if (key1 != key2 || val1 != val2) return false;
+  // Lexicographic over (key, value) entries in key order, like std::map.
+  auto operator<=>(const BSTMap& other) const {
+    SynthThreeWay synthThreeWay;
+    using Ordering = common_comparison_category_t<decltype(synthThreeWay(declval<KeyT>(), declval<KeyT>())),
+                                                  decltype(synthThreeWay(declval<ValT>(), declval<ValT>()))>;
+    BSTNode* a = minNode;
+    BSTNode* b = other.minNode;
+    for (; a && b; a = successor(a), b = successor(b)) {
+      if (auto cmp = synthThreeWay(a->key, b->key); cmp != 0) return Ordering(cmp);
+      if (auto cmp = synthThreeWay(a->value, b->value); cmp != 0) return Ordering(cmp);
     }
+    return Ordering(sz <=> other.sz);
   }
 
-  void begin() {
-    curr = root;
-    if (!curr) return;
-    while (curr->left) curr = curr->left;
+  // The non-const begin() also rewinds the legacy next() cursor, so the
+  // old "begin(); while (next(k, v))" loop keeps working.
+  iterator begin() {
+    curr = minNode;
+    return iterator(curr, this);
   }
 
+  const_iterator begin() const { return const_iterator(minNode, this); }
+  const_iterator cbegin() const { return begin(); }
+
+  iterator end() { return iterator(nullptr, this); }
+  const_iterator end() const { return const_iterator(nullptr, this); }
+  const_iterator cend() const { return end(); }
+
   bool next(KeyT& key, ValT& val) {
     if (!curr) return false;
     key = curr->key;
     val = curr->value;
-
-    if (curr->right) {
-      curr = curr->right;
-      while (curr->left) curr = curr->left;
-    } else {
-      BSTNode* parent = curr->parent;
-      while (parent && curr == parent->right) {
-        curr = parent;
-        parent = parent->parent;
-      }
-      curr = parent;
-    }
-
+    curr = successor(curr);
     return true;
   }
 
   ValT erase(const KeyT& key) {
-    BSTNode* current = root;
-    BSTNode* parent = nullptr;
-
-    while (current && current->key != key) {
-      parent = current;
-      if (key < current->key) current = current->left;
-      else current = current->right;
-    }
-
+    BSTNode* current = findNode(key, Erase);
     if (!current) throw out_of_range("Key not found");
 
-    ValT value_to_return = current->value;
-
-    if (!current->left && !current->right) {
-      if (!parent) root = nullptr;
-      else if (parent->left == current) parent->left = nullptr;
-      else parent->right = nullptr;
-      delete current;
-      sz--;
-      return value_to_return;
-    }
-
-    if (!current->left || !current->right) {
-      BSTNode* child = (current->left) ? current->left : current->right;
-      if (!parent) root = child;
-      else if (parent->left == current) parent->left = child;
-      else parent->right = child;
-      if (child) child->parent = parent;
-      delete current;
-      sz--;
-      return value_to_return;
-    }
-
-    BSTNode* successor = current->right;
-    BSTNode* successorParent = current;
-    while (successor->left) {
-      successorParent = successor;
-      successor = successor->left;
-    }
+    ValT value_to_return = std::move(current->value);
+    eraseNode(current);
+    return value_to_return;
+  }
 
-    const_cast<KeyT&>(current->key) = successor->key;
-    current->value = successor->value;
+  // Removes the entry at pos and returns an iterator to the entry after it.
+  iterator erase(const_iterator pos) { return iterator(eraseNode(pos.node), this); }
 
-    if (successorParent->left == successor)
-      successorParent->left = successor->right;
-    else
-      successorParent->right = successor->right;
+  // Unlinks key's entry and hands over its node, or returns an empty handle
+  // if key is absent. Nothing is copied, and every other entry stays where
+  // it is, so iterators and references to them remain valid.
+  node_type extract(const KeyT& key) {
+    BSTNode* node = findNode(key, Erase);
+    if (!node) return node_type();
+    return extract(const_iterator(node, this));
+  }
 
-    if (successor->right) successor->right->parent = successorParent;
+  node_type extract(const_iterator pos) {
+    detachNode(pos.node);
+    return node_type(pos.node, alloc);
+  }
 
-    delete successor;
-    sz--;
-    return value_to_return;
+  // Links the handle's entry in unless its key is already present, in which
+  // case the handle is returned with the entry still in it. The node itself
+  // is relinked when this map shares the allocator it came from; otherwise
+  // the entry is moved into a node from this map's allocator.
+  insert_return_type insert(node_type&& handle) {
+    if (handle.empty()) return {end(), false, node_type()};
+    BSTNode* parent;
+    bool left;
+    if (BSTNode* found = findSlot(handle.key(), parent, left)) return {iterator(found, this), false, std::move(handle)};
+    BSTNode* node;
+    if (*handle.alloc == alloc) {
+      node = handle.release();
+      node->parent = parent;
+      updateNode(node);
+    } else {
+      node = newNode(parent, std::move(const_cast<KeyT&>(handle.node->key)), std::move(handle.node->value));
+      handle.reset();
+    }
+    attachNode(node, parent, left);
+    return {iterator(node, this), true, node_type()};
   }
 
   void* getRoot() const { return this->root; }
-};
\ No newline at end of file
+};
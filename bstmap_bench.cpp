@@ -0,0 +1,530 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <malloc.h>
+
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstmap.h"
+#include "btreemap.h"
+#include "compactmap.h"
+#include "concurrentmap.h"
+#include "persistentmap.h"
+#include "shardedmap.h"
+
+using namespace std;
+
+namespace {
+
+template <typename Balance>
+void BM_InsertSorted(benchmark::State& state) {
+  const int n = state.range(0);
+  for (auto _ : state) {
+    BSTMap<int, int, Balance> bst;
+    for (int i = 0; i < n; i++) {
+      bst.insert(i, i);
+    }
+    benchmark::DoNotOptimize(bst.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// The plain tree degenerates into a list on sorted input, so it only runs at
+// sizes where O(n^2) still finishes.
+BENCHMARK_TEMPLATE(BM_InsertSorted, NoBalance)->Arg(10'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InsertSorted, AVLBalance)
+    ->Arg(10'000)
+    ->Arg(10'000'000)
+    ->Unit(benchmark::kMillisecond);
+
+vector<int> shuffledKeys(int n) {
+  vector<int> keys(n);
+  for (int i = 0; i < n; i++) keys[i] = i;
+  shuffle(keys.begin(), keys.end(), mt19937(12345));
+  return keys;
+}
+
+template <typename Alloc>
+void BM_InsertClearRandom(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  for (auto _ : state) {
+    BSTMap<int, int, AVLBalance, Alloc> bst;
+    for (int key : keys) {
+      bst.insert(key, key);
+    }
+    bst.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+BENCHMARK_TEMPLATE(BM_InsertClearRandom, allocator<pair<const int, int>>)
+    ->Arg(100'000)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InsertClearRandom, NodePool<pair<const int, int>>)
+    ->Arg(100'000)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_LoadSnapshot_Insert(benchmark::State& state) {
+  const int n = state.range(0);
+  for (auto _ : state) {
+    BSTMap<int, int, AVLBalance> bst;
+    for (int i = 0; i < n; i++) {
+      bst.insert(i, i);
+    }
+    benchmark::DoNotOptimize(bst.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+void BM_LoadSnapshot_AssignSorted(benchmark::State& state) {
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < state.range(0); i++) entries.push_back({i, i});
+  for (auto _ : state) {
+    BSTMap<int, int, AVLBalance> bst(entries.begin(), entries.end());
+    benchmark::DoNotOptimize(bst.size());
+  }
+  state.SetItemsProcessed(state.iterations() * entries.size());
+}
+
+BENCHMARK(BM_LoadSnapshot_Insert)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadSnapshot_AssignSorted)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// operator== as it was before the lock-step walk: copy both maps, then
+// compare them through the begin()/next() cursor.
+template <typename Map>
+bool copyingEquals(const Map& map1, const Map& map2) {
+  if (map1.size() != map2.size()) return false;
+  Map this_copy(map1);
+  Map other_copy(map2);
+  this_copy.begin();
+  other_copy.begin();
+  int key1, key2, val1, val2;
+  while (this_copy.next(key1, val1) && other_copy.next(key2, val2)) {
+    if (key1 != key2 || val1 != val2) return false;
+  }
+  return true;
+}
+
+void BM_Equals_Copying(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  BSTMap<int, int, AVLBalance> map1, map2;
+  for (int key : keys) map1.insert(key, key);
+  for (int i = 0; i < state.range(0); i++) map2.insert(i, i);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(copyingEquals(map1, map2));
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+void BM_Equals_LockStep(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  BSTMap<int, int, AVLBalance> map1, map2;
+  for (int key : keys) map1.insert(key, key);
+  for (int i = 0; i < state.range(0); i++) map2.insert(i, i);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map1 == map2);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+BENCHMARK(BM_Equals_Copying)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Equals_LockStep)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+template <typename Map>
+void BM_LookupRandom(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  Map map;
+  for (int key : keys) map.insert(key, key);
+  shuffle(keys.begin(), keys.end(), mt19937(99));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map.at(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_LookupRandom, BSTMap<int, int, AVLBalance>)->Arg(1'000'000)->Arg(10'000'000);
+BENCHMARK_TEMPLATE(BM_LookupRandom, BTreeMap<int, int>)->Arg(1'000'000)->Arg(10'000'000);
+BENCHMARK_TEMPLATE(BM_LookupRandom, CompactBSTMap<int, int>)->Arg(1'000'000)->Arg(10'000'000);
+// The counting statistics policy, to see what instrumentation costs.
+BENCHMARK_TEMPLATE(BM_LookupRandom,
+                   BSTMap<int, int, AVLBalance, NodePool<pair<const int, int>>, SynthThreeWay, CountStats>)
+    ->Arg(1'000'000);
+
+// Same workload against a frozen snapshot of the AVL map.
+void BM_LookupRandom_Frozen(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  BSTMap<int, int, AVLBalance> map;
+  for (int key : keys) map.insert(key, key);
+  FrozenMap<int, int> frozen = map.freeze();
+  map.clear();
+  shuffle(keys.begin(), keys.end(), mt19937(99));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(frozen.at(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_LookupRandom_Frozen)->Arg(1'000'000)->Arg(10'000'000);
+
+// A BSTMap behind one global mutex, the way callers shared it before
+// ConcurrentBSTMap.
+class LockedBSTMap {
+ private:
+  mutable mutex lock;
+  BSTMap<int, int, AVLBalance> map;
+
+ public:
+  bool contains(int key) const {
+    lock_guard<mutex> guard(lock);
+    return map.contains(key);
+  }
+
+  void insert(int key, int value) {
+    lock_guard<mutex> guard(lock);
+    map.insert(key, value);
+  }
+
+  int erase(int key) {
+    lock_guard<mutex> guard(lock);
+    return map.erase(key);
+  }
+};
+
+// Threads share one map of up to 100K keys; ReadPercent of the operations
+// are lookups and the rest flip a random key in or out.
+template <typename Map, int ReadPercent>
+void BM_SharedMixed(benchmark::State& state) {
+  constexpr int keyRange = 100'000;
+  static Map* map;
+  if (state.thread_index() == 0) {
+    map = new Map;
+    for (int key : shuffledKeys(keyRange)) {
+      if (key % 2 == 0) map->insert(key, key);
+    }
+  }
+  mt19937 rng(state.thread_index());
+  for (auto _ : state) {
+    int key = rng() % keyRange;
+    if (static_cast<int>(rng() % 100) < ReadPercent) {
+      benchmark::DoNotOptimize(map->contains(key));
+    } else if (map->contains(key)) {
+      try {
+        map->erase(key);
+      } catch (const out_of_range&) {
+        // Another writer got there first.
+      }
+    } else {
+      map->insert(key, key);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) delete map;
+}
+
+BENCHMARK_TEMPLATE(BM_SharedMixed, LockedBSTMap, 90)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SharedMixed, ConcurrentBSTMap<int, int>, 90)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SharedMixed, LockedBSTMap, 50)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SharedMixed, ConcurrentBSTMap<int, int>, 50)->ThreadRange(1, 32)->UseRealTime();
+
+// Write-only mix: every operation inserts or erases.
+BENCHMARK_TEMPLATE(BM_SharedMixed, LockedBSTMap, 0)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SharedMixed, ShardedBSTMap<int, int>, 0)->ThreadRange(1, 32)->UseRealTime();
+
+// Point-in-time copy of an n-entry map followed by one write to the
+// original, the pattern of a reader scanning while a writer continues.
+template <typename Map>
+void BM_SnapshotThenWrite(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  Map map;
+  for (int key : keys) map.insert(key, key);
+  int next = state.range(0);
+  for (auto _ : state) {
+    Map snapshot(map);
+    map.insert(next++, 0);
+    benchmark::DoNotOptimize(snapshot.size());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_SnapshotThenWrite, BSTMap<int, int, AVLBalance>)
+    ->Arg(100'000)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_SnapshotThenWrite, PersistentBSTMap<int, int>)
+    ->Arg(100'000)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMicrosecond);
+
+// String keys with a long shared prefix, where every key comparison has to
+// scan most of both strings.
+void BM_LookupRandomString(benchmark::State& state) {
+  vector<int> ids = shuffledKeys(state.range(0));
+  vector<string> keys;
+  keys.reserve(ids.size());
+  for (int id : ids) keys.push_back("customer/region-eu/account-" + std::to_string(id));
+  BSTMap<string, int, AVLBalance> map;
+  for (const string& key : keys) map.insert(key, 0);
+  shuffle(keys.begin(), keys.end(), mt19937(99));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map.contains(keys[i]));
+    if (++i == keys.size()) i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_LookupRandomString)->Arg(100'000)->Arg(1'000'000);
+
+// Resolves 256 random keys per iteration, like one request of the handler,
+// either one at() at a time or with a single find_batch() call.
+template <bool Batched>
+void BM_LookupRequest(benchmark::State& state) {
+  constexpr size_t perRequest = 256;
+  vector<int> keys = shuffledKeys(state.range(0));
+  BSTMap<int, int, AVLBalance> map;
+  for (int key : keys) map.insert(key, key);
+  shuffle(keys.begin(), keys.end(), mt19937(99));
+  vector<int*> out(perRequest);
+  size_t base = 0;
+  for (auto _ : state) {
+    span<const int> request(keys.data() + base, perRequest);
+    if constexpr (Batched) {
+      map.find_batch(request, out);
+      benchmark::DoNotOptimize(out.data());
+    } else {
+      for (int key : request) benchmark::DoNotOptimize(map.at(key));
+    }
+    base += perRequest;
+    if (base + perRequest > keys.size()) base = 0;
+  }
+  state.SetItemsProcessed(state.iterations() * perRequest);
+}
+
+BENCHMARK_TEMPLATE(BM_LookupRequest, false)->Arg(1'000'000)->Arg(10'000'000);
+BENCHMARK_TEMPLATE(BM_LookupRequest, true)->Arg(1'000'000)->Arg(10'000'000);
+
+// Merges an n-entry map into another n-entry map over overlapping random
+// keys, either by inserting every entry or with one union_with() call.
+template <bool SetOp>
+void BM_Merge(benchmark::State& state) {
+  const int n = state.range(0);
+  mt19937 rng(7);
+  BSTMap<int, int, AVLBalance> source, other;
+  for (int i = 0; i < n; i++) {
+    source.insert(rng() % (4 * n), i);
+    other.insert(rng() % (4 * n), i);
+  }
+  for (auto _ : state) {
+    state.PauseTiming();
+    BSTMap<int, int, AVLBalance> target(source);
+    state.ResumeTiming();
+    if constexpr (SetOp) {
+      target.union_with(other);
+    } else {
+      for (auto [key, value] : other) target.insert(key, value);
+    }
+    benchmark::DoNotOptimize(target.size());
+  }
+  state.SetItemsProcessed(state.iterations() * other.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Merge, false)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge, true)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Restores an n-entry map exported earlier, either by parsing to_string()
+// text and inserting each entry or with load() on a save() file.
+template <bool Binary>
+void BM_Restore(benchmark::State& state) {
+  const int n = state.range(0);
+  BSTMap<int, int, AVLBalance> source;
+  for (int key : shuffledKeys(n)) source.insert(key, key / 2);
+  string path = "/tmp/bm_restore.bin";
+  string text = source.to_string();
+  if constexpr (Binary) source.save(path);
+  for (auto _ : state) {
+    BSTMap<int, int, AVLBalance> restored;
+    if constexpr (Binary) {
+      restored.load(path);
+    } else {
+      istringstream in(text);
+      int key, value;
+      char colon;
+      while (in >> key >> colon >> value) restored.insert(key, value);
+    }
+    benchmark::DoNotOptimize(restored.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  remove(path.c_str());
+}
+
+BENCHMARK_TEMPLATE(BM_Restore, false)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Restore, true)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Dumps an n-entry map as text, into one string with to_string() or
+// straight into a file stream with write_to().
+template <bool Streaming>
+void BM_WriteText(benchmark::State& state) {
+  const int n = state.range(0);
+  BSTMap<int, double, AVLBalance> map;
+  for (int key : shuffledKeys(n)) map.insert(key, key / 3.0);
+  ofstream sink("/dev/null");
+  for (auto _ : state) {
+    if constexpr (Streaming) {
+      map.write_to(sink);
+    } else {
+      string text = map.to_string();
+      benchmark::DoNotOptimize(text.data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_WriteText, false)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_WriteText, true)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Drains an n-entry map in key order, one remove_min() at a time or 256
+// entries per pop_min_batch().
+template <bool Batched>
+void BM_DrainQueue(benchmark::State& state) {
+  const int n = state.range(0);
+  BSTMap<int, int, AVLBalance> source;
+  for (int key : shuffledKeys(n)) source.insert(key, key);
+  vector<pair<int, int>> batch;
+  batch.reserve(256);
+  for (auto _ : state) {
+    state.PauseTiming();
+    BSTMap<int, int, AVLBalance> queue(source);
+    state.ResumeTiming();
+    while (!queue.empty()) {
+      if constexpr (Batched) {
+        batch.clear();
+        queue.pop_min_batch(256, back_inserter(batch));
+        benchmark::DoNotOptimize(batch.data());
+      } else {
+        benchmark::DoNotOptimize(queue.remove_min());
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_DrainQueue, false)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_DrainQueue, true)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Erase every key in random order with 256-byte values, which cost a copy
+// whenever an erase moves an entry between nodes.
+void BM_EraseLargeValues(benchmark::State& state) {
+  using Map = BSTMap<int, array<char, 256>, AVLBalance>;
+  const int n = state.range(0);
+  Map source;
+  for (int key : shuffledKeys(n)) source.insert(key, {});
+  vector<int> order = shuffledKeys(n);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map map(source);
+    state.ResumeTiming();
+    for (int key : order) map.erase(map.find(key));
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK(BM_EraseLargeValues)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Moves every entry from one map into another that shares its pool, either
+// as a node handle or by inserting a copy and erasing the original.
+template <bool Extract>
+void BM_TransferEntries(benchmark::State& state) {
+  using Map = BSTMap<int, array<char, 256>, AVLBalance>;
+  const int n = state.range(0);
+  Map source;
+  for (int key : shuffledKeys(n)) source.insert(key, {});
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map from(source);
+    Map to(from.get_allocator());
+    state.ResumeTiming();
+    while (!from.empty()) {
+      if constexpr (Extract) {
+        to.insert(from.extract(from.begin()));
+      } else {
+        auto first = from.begin();
+        to.insert(first->first, first->second);
+        from.erase(first);
+      }
+    }
+    benchmark::DoNotOptimize(to.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_TransferEntries, false)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_TransferEntries, true)->Arg(100'000)->Arg(1'000'000)->Unit(benchmark::kMillisecond);
+
+// Inserts timestamp-like keys that arrive almost in order: each one lands
+// within a few entries of the last, either from the root or hinted with the
+// position of the previous insert.
+template <bool Hinted>
+void BM_InsertNearlySorted(benchmark::State& state) {
+  const int n = state.range(0);
+  mt19937 rng(7);
+  vector<int> keys(n);
+  for (int i = 0; i < n; i++) keys[i] = i * 16 + int(rng() % 64);
+  for (auto _ : state) {
+    BSTMap<int, int, AVLBalance> map;
+    auto last = map.end();
+    for (int key : keys) {
+      if constexpr (Hinted) last = map.insert(last, key, key);
+      else map.insert(key, key);
+    }
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK_TEMPLATE(BM_InsertNearlySorted, false)->Arg(1'000'000)->Arg(10'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InsertNearlySorted, true)->Arg(1'000'000)->Arg(10'000'000)->Unit(benchmark::kMillisecond);
+
+// Heap bytes in use, as glibc's malloc counts them (mmapped blocks too).
+size_t heapBytes() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// Builds a map from n random int keys and reports the heap it holds per
+// entry, allocator headers and spare capacity included.
+template <typename Map>
+void BM_Footprint(benchmark::State& state) {
+  vector<int> keys = shuffledKeys(state.range(0));
+  double perEntry = 0;
+  for (auto _ : state) {
+    size_t before = heapBytes();
+    Map map;
+    if constexpr (requires { map.reserve(keys.size()); }) map.reserve(keys.size());
+    for (int key : keys) map.insert(key, key);
+    perEntry = double(heapBytes() - before) / keys.size();
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.counters["bytes_per_entry"] = perEntry;
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+BENCHMARK_TEMPLATE(BM_Footprint, BSTMap<int, int, AVLBalance>)->Arg(10'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Footprint, CompactBSTMap<int, int>)->Arg(10'000'000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Footprint, BTreeMap<int, int>)->Arg(10'000'000)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,300 @@
+// BSTMap against std::map: every operation below runs over int and string
+// keys, four key distributions and sizes from 1K to 10M. Names read
+// BM_Compare/<operation>/<map>/<distribution>/<size>; filter with
+// --benchmark_filter and record with --benchmark_out=<file>.json.
+// BM_Compare/skewed_at/<map>/<size> pits the balancing policies against
+// each other on Zipfian lookups.
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bstmap.h"
+
+using namespace std;
+
+namespace {
+
+enum class Distribution { Sorted, Reverse, Random, Zipf };
+
+const char* distributionName(Distribution dist) {
+  switch (dist) {
+    case Distribution::Sorted: return "sorted";
+    case Distribution::Reverse: return "reverse";
+    case Distribution::Random: return "random";
+    case Distribution::Zipf: return "zipf";
+  }
+  return "";
+}
+
+// Draws ranks 0..n-1 with P(rank i) proportional to 1 / (i + 1)^theta, by
+// the constant-time approximation YCSB uses.
+class ZipfGenerator {
+ private:
+  double theta, alpha, zetaN, eta;
+  size_t n;
+
+ public:
+  explicit ZipfGenerator(size_t n, double theta = 0.99) : theta(theta), alpha(1 / (1 - theta)), zetaN(0), n(n) {
+    for (size_t i = 1; i <= n; i++) zetaN += 1 / pow(double(i), theta);
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetaN);
+  }
+
+  template <typename Rng>
+  size_t operator()(Rng& rng) {
+    double u = uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetaN;
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, theta)) return 1;
+    return min(n - 1, size_t(n * pow(eta * u - eta + 1, alpha)));
+  }
+};
+
+// Key number i as a map key. Strings are zero padded so they sort like the
+// numbers, and short enough to stay in the small-string buffer.
+template <typename KeyT>
+KeyT makeKey(int i) {
+  if constexpr (is_same_v<KeyT, string>) {
+    char text[16];
+    snprintf(text, sizeof(text), "key:%010d", i);
+    return text;
+  } else {
+    return i;
+  }
+}
+
+// n keys in the order dist produces them. Zipfian keys repeat: the hottest
+// keys are scattered over the key space rather than being the smallest.
+template <typename KeyT>
+vector<KeyT> keySequence(Distribution dist, int n) {
+  vector<int> numbers(n);
+  iota(numbers.begin(), numbers.end(), 0);
+  mt19937 rng(42);
+  if (dist == Distribution::Reverse) {
+    reverse(numbers.begin(), numbers.end());
+  } else if (dist == Distribution::Random) {
+    shuffle(numbers.begin(), numbers.end(), rng);
+  } else if (dist == Distribution::Zipf) {
+    vector<int> byRank(numbers);
+    shuffle(byRank.begin(), byRank.end(), rng);
+    ZipfGenerator zipf(n);
+    for (int& number : numbers) number = byRank[zipf(rng)];
+  }
+  vector<KeyT> keys;
+  keys.reserve(n);
+  for (int number : numbers) keys.push_back(makeKey<KeyT>(number));
+  return keys;
+}
+
+// The few calls whose spelling differs between the two maps.
+template <typename KeyT, typename Balance>
+void insertEntry(BSTMap<KeyT, int, Balance>& map, const KeyT& key, int value) {
+  map.insert(key, value);
+}
+
+template <typename KeyT>
+void insertEntry(map<KeyT, int>& map, const KeyT& key, int value) {
+  map.emplace(key, value);
+}
+
+template <typename KeyT>
+void removeMin(BSTMap<KeyT, int, AVLBalance>& map) {
+  map.remove_min();
+}
+
+template <typename KeyT>
+void removeMin(map<KeyT, int>& map) {
+  map.erase(map.begin());
+}
+
+template <typename KeyT>
+string toText(const BSTMap<KeyT, int, AVLBalance>& map) {
+  return map.to_string();
+}
+
+// std::map has no to_string; this prints the same lines.
+template <typename KeyT>
+string toText(const map<KeyT, int>& map) {
+  ostringstream ss;
+  for (const auto& [key, value] : map) ss << key << ": " << value << '\n';
+  return ss.str();
+}
+
+// Every benchmark of one map type, key type and distribution starts from
+// the same key sequence; all but insert also start from the map built by
+// inserting it in that order.
+template <typename Map>
+struct Fixture {
+  using KeyT = typename Map::key_type;
+
+  vector<KeyT> keys;
+  Map built;
+
+  Fixture(Distribution dist, int n) : keys(keySequence<KeyT>(dist, n)) {
+    for (size_t i = 0; i < keys.size(); i++) insertEntry(built, keys[i], int(i));
+  }
+};
+
+template <typename Map>
+void BM_Insert(benchmark::State& state, Distribution dist) {
+  auto keys = keySequence<typename Map::key_type>(dist, state.range(0));
+  for (auto _ : state) {
+    Map map;
+    for (size_t i = 0; i < keys.size(); i++) insertEntry(map, keys[i], int(i));
+    benchmark::DoNotOptimize(map.size());
+    state.PauseTiming();  // leave the teardown out
+    map = Map();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <typename Map>
+void BM_At(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  for (auto _ : state) {
+    for (const auto& key : fixture.keys) benchmark::DoNotOptimize(fixture.built.at(key));
+  }
+  state.SetItemsProcessed(state.iterations() * fixture.keys.size());
+}
+
+template <typename Map>
+void BM_Contains(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  for (auto _ : state) {
+    for (const auto& key : fixture.keys) benchmark::DoNotOptimize(fixture.built.contains(key));
+  }
+  state.SetItemsProcessed(state.iterations() * fixture.keys.size());
+}
+
+// Erases every key once, in the order the distribution first produced it.
+template <typename Map>
+void BM_Erase(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  vector<typename Map::key_type> order;
+  Map seen;
+  for (const auto& key : fixture.keys) {
+    if (!seen.contains(key)) {
+      insertEntry(seen, key, 0);
+      order.push_back(key);
+    }
+  }
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map map(fixture.built);
+    state.ResumeTiming();
+    for (const auto& key : order) map.erase(key);
+    benchmark::DoNotOptimize(map.size());
+  }
+  state.SetItemsProcessed(state.iterations() * order.size());
+}
+
+template <typename Map>
+void BM_RemoveMin(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map map(fixture.built);
+    state.ResumeTiming();
+    while (!map.empty()) removeMin(map);
+  }
+  state.SetItemsProcessed(state.iterations() * fixture.built.size());
+}
+
+template <typename Map>
+void BM_Copy(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  for (auto _ : state) {
+    Map copy(fixture.built);
+    benchmark::DoNotOptimize(copy.size());
+    state.PauseTiming();
+    copy = Map();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * fixture.built.size());
+}
+
+template <typename Map>
+void BM_Equal(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  Map copy(fixture.built);
+  for (auto _ : state) benchmark::DoNotOptimize(fixture.built == copy);
+  state.SetItemsProcessed(state.iterations() * fixture.built.size());
+}
+
+template <typename Map>
+void BM_ToString(benchmark::State& state, Distribution dist) {
+  Fixture<Map> fixture(dist, state.range(0));
+  for (auto _ : state) {
+    string text = toText(fixture.built);
+    benchmark::DoNotOptimize(text.data());
+  }
+  state.SetItemsProcessed(state.iterations() * fixture.built.size());
+}
+
+// at() with Zipfian keys on a map built from every key in an unrelated
+// random order, so the hot keys start out at ordinary depths.
+template <typename Map>
+void BM_SkewedAt(benchmark::State& state) {
+  using KeyT = typename Map::key_type;
+  const int n = state.range(0);
+  vector<KeyT> keys = keySequence<KeyT>(Distribution::Sorted, n);
+  shuffle(keys.begin(), keys.end(), mt19937(7));
+  Map map;
+  for (const auto& key : keys) insertEntry(map, key, 0);
+  vector<KeyT> lookups = keySequence<KeyT>(Distribution::Zipf, n);
+  for (auto _ : state) {
+    for (const auto& key : lookups) benchmark::DoNotOptimize(map.at(key));
+  }
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+
+template <typename Map>
+void registerSkewed(const string& mapName) {
+  string name = "BM_Compare/skewed_at/" + mapName;
+  benchmark::RegisterBenchmark(name.c_str(), BM_SkewedAt<Map>)
+      ->RangeMultiplier(10)
+      ->Range(1'000, 10'000'000)
+      ->Unit(benchmark::kMicrosecond);
+}
+
+template <typename Map>
+void registerMap(const string& mapName) {
+  using Benchmark = void (*)(benchmark::State&, Distribution);
+  const pair<const char*, Benchmark> operations[] = {
+      {"insert", BM_Insert<Map>},          {"at", BM_At<Map>},     {"contains", BM_Contains<Map>},
+      {"erase", BM_Erase<Map>},            {"remove_min", BM_RemoveMin<Map>}, {"copy", BM_Copy<Map>},
+      {"operator==", BM_Equal<Map>},       {"to_string", BM_ToString<Map>},
+  };
+  for (auto [operation, run] : operations) {
+    for (Distribution dist : {Distribution::Sorted, Distribution::Reverse, Distribution::Random, Distribution::Zipf}) {
+      string name = string("BM_Compare/") + operation + "/" + mapName + "/" + distributionName(dist);
+      benchmark::RegisterBenchmark(name.c_str(), run, dist)
+          ->RangeMultiplier(10)
+          ->Range(1'000, 10'000'000)
+          ->Unit(benchmark::kMicrosecond);
+    }
+  }
+}
+
+const bool registered = [] {
+  registerMap<BSTMap<int, int, AVLBalance>>("BSTMap<int>");
+  registerMap<map<int, int>>("std::map<int>");
+  registerMap<BSTMap<string, int, AVLBalance>>("BSTMap<string>");
+  registerMap<map<string, int>>("std::map<string>");
+  registerSkewed<BSTMap<int, int, NoBalance>>("BSTMap<int,plain>");
+  registerSkewed<BSTMap<int, int, AVLBalance>>("BSTMap<int,avl>");
+  registerSkewed<BSTMap<int, int, SplayBalance>>("BSTMap<int,splay>");
+  registerSkewed<map<int, int>>("std::map<int>");
+  return true;
+}();
+
+}  // namespace
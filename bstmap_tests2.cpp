@@ -1,9 +1,26 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <pthread.h>
 
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <string_view>
+#include <thread>
 
 #include "bstmap.h"
+#include "btreemap.h"
+#include "compactmap.h"
+#include "concurrentmap.h"
+#include "persistentmap.h"
+#include "shardedmap.h"
 
 using namespace std;
 using namespace testing;
@@ -29,9 +46,106 @@ class Random {
 
 std::mt19937 Random::rng;
 
+struct CopyCounter {
+  static int copies;
+  static int constructions;
+  int id;
 
-TEST(BSTMapCore, InsertAndSizegood) {
-  BSTMap<int, string> bst;
+  explicit CopyCounter(int id) : id(id) { constructions++; }
+  CopyCounter(const CopyCounter& other) : id(other.id) { copies++; }
+  CopyCounter(CopyCounter&& other) noexcept : id(other.id) {}
+  CopyCounter& operator=(const CopyCounter& other) {
+    id = other.id;
+    copies++;
+    return *this;
+  }
+  CopyCounter& operator=(CopyCounter&& other) noexcept {
+    id = other.id;
+    return *this;
+  }
+};
+
+int CopyCounter::copies = 0;
+int CopyCounter::constructions = 0;
+
+struct AllocCounts {
+  int allocs = 0;
+  int frees = 0;
+};
+
+template <typename T>
+struct CountingAllocator {
+  using value_type = T;
+  AllocCounts* counts;
+
+  explicit CountingAllocator(AllocCounts* counts) : counts(counts) {}
+
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>& other) : counts(other.counts) {}
+
+  T* allocate(size_t n) {
+    counts->allocs++;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    counts->frees++;
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const CountingAllocator<U>& other) const {
+    return counts == other.counts;
+  }
+};
+
+
+// The core suites run against every map implementation. The 16-byte
+// B-tree gets the minimum fan-out, so even short sequences split and merge.
+struct BSTImpl {
+  template <typename K, typename V>
+  using Map = BSTMap<K, V>;
+};
+
+struct AVLImpl {
+  template <typename K, typename V>
+  using Map = BSTMap<K, V, AVLBalance>;
+};
+
+struct BTreeImpl {
+  template <typename K, typename V>
+  using Map = BTreeMap<K, V>;
+};
+
+struct TinyBTreeImpl {
+  template <typename K, typename V>
+  using Map = BTreeMap<K, V, 16>;
+};
+
+struct CompactImpl {
+  template <typename K, typename V>
+  using Map = CompactBSTMap<K, V>;
+};
+
+template <typename Impl, typename K, typename V>
+using MapOf = typename Impl::template Map<K, V>;
+
+using MapImpls = Types<BSTImpl, AVLImpl, BTreeImpl, TinyBTreeImpl, CompactImpl>;
+
+template <typename Impl>
+class BSTMapCore : public Test {};
+TYPED_TEST_SUITE(BSTMapCore, MapImpls);
+
+template <typename Impl>
+class BSTMapAugmented : public Test {};
+TYPED_TEST_SUITE(BSTMapAugmented, MapImpls);
+
+template <typename Impl>
+class BSTMapErase : public Test {};
+TYPED_TEST_SUITE(BSTMapErase, MapImpls);
+
+TYPED_TEST(BSTMapCore, InsertAndSizegood) {
+  MapOf<TypeParam, int, string> bst;
   EXPECT_EQ(bst.size(), 0);
   EXPECT_TRUE(bst.empty());
   
@@ -44,8 +158,8 @@ TEST(BSTMapCore, InsertAndSizegood) {
   EXPECT_EQ(bst.size(), 3);
 }
 
-TEST(BSTMapCore, InsertDuplicateKeygood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapCore, InsertDuplicateKeygood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(5, "new_five");
   
@@ -53,8 +167,8 @@ TEST(BSTMapCore, InsertDuplicateKeygood) {
   EXPECT_EQ(bst.at(5), "five");
 }
 
-TEST(BSTMapCore, Containsgood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapCore, Containsgood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -66,8 +180,8 @@ TEST(BSTMapCore, Containsgood) {
   EXPECT_FALSE(bst.contains(10));
 }
 
-TEST(BSTMapCore, Atgood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapCore, Atgood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   
@@ -77,8 +191,8 @@ TEST(BSTMapCore, Atgood) {
   EXPECT_THROW(bst.at(10), out_of_range);
 }
 
-TEST(BSTMapCore, ToStringgood) {
-  BSTMap<int, int> bst;
+TYPED_TEST(BSTMapCore, ToStringgood) {
+  MapOf<TypeParam, int, int> bst;
   bst.insert(3, 30);
   bst.insert(1, 10);
   bst.insert(4, 40);
@@ -93,8 +207,8 @@ TEST(BSTMapCore, ToStringgood) {
   EXPECT_EQ(bst.to_string(), expected);
 }
 
-TEST(BSTMapCore, Cleargood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapCore, Cleargood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -109,13 +223,13 @@ TEST(BSTMapCore, Cleargood) {
   EXPECT_TRUE(bst.contains(1));
 }
 
-TEST(BSTMapCore, CopyConstructorgood) {
-  BSTMap<int, string> original;
+TYPED_TEST(BSTMapCore, CopyConstructorgood) {
+  MapOf<TypeParam, int, string> original;
   original.insert(5, "five");
   original.insert(3, "three");
   original.insert(7, "seven");
   
-  BSTMap<int, string> copy(original);
+  MapOf<TypeParam, int, string> copy(original);
   
   EXPECT_EQ(original.size(), copy.size());
   EXPECT_EQ(original.at(5), copy.at(5));
@@ -126,11 +240,11 @@ TEST(BSTMapCore, CopyConstructorgood) {
   EXPECT_FALSE(copy.contains(10));
 }
 
-TEST(BSTMapCore, AssignmentOperator) {
-  BSTMap<int, string> original;
+TYPED_TEST(BSTMapCore, AssignmentOperator) {
+  MapOf<TypeParam, int, string> original;
   original.insert(5, "five");
   original.insert(3, "three");
-  BSTMap<int, string> copy;
+  MapOf<TypeParam, int, string> copy;
   copy.insert(1, "one");
   copy = original;
   
@@ -140,17 +254,17 @@ TEST(BSTMapCore, AssignmentOperator) {
   EXPECT_FALSE(copy.contains(1));
 }
 
-TEST(BSTMapCore, CopyConstructorEmpty) {
-  BSTMap<int, string> empty_map;
-  BSTMap<int, string> copy(empty_map);
+TYPED_TEST(BSTMapCore, CopyConstructorEmpty) {
+  MapOf<TypeParam, int, string> empty_map;
+  MapOf<TypeParam, int, string> copy(empty_map);
   
   EXPECT_TRUE(copy.empty());
   EXPECT_EQ(copy.size(), 0);
 }
 
-TEST(BSTMapCore, AssignmentEmpty) {
-  BSTMap<int, string> empty_map;
-  BSTMap<int, string> target;
+TYPED_TEST(BSTMapCore, AssignmentEmpty) {
+  MapOf<TypeParam, int, string> empty_map;
+  MapOf<TypeParam, int, string> target;
   target.insert(5, "five");  
   
   target = empty_map;  
@@ -158,12 +272,12 @@ TEST(BSTMapCore, AssignmentEmpty) {
   EXPECT_EQ(target.size(), 0);
 }
 
-TEST(BSTMapCore, SelfAssignment) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapCore, SelfAssignment) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   
-  BSTMap<int, string>& self_ref = bst;  
+  MapOf<TypeParam, int, string>& self_ref = bst;  
   bst = self_ref; 
   EXPECT_EQ(bst.size(), 2);
   EXPECT_TRUE(bst.contains(5));
@@ -172,13 +286,13 @@ TEST(BSTMapCore, SelfAssignment) {
   EXPECT_EQ(bst.at(3), "three");
 }
 
-TEST(BSTMapCore, CopyConstructorDeepCopy) {
-  BSTMap<int, string> original;
+TYPED_TEST(BSTMapCore, CopyConstructorDeepCopy) {
+  MapOf<TypeParam, int, string> original;
   original.insert(5, "five");
   original.insert(3, "three");
   original.insert(7, "seven");
   
-  BSTMap<int, string> copy(original);
+  MapOf<TypeParam, int, string> copy(original);
   original.insert(10, "ten");
   original.erase(3);
   
@@ -190,13 +304,13 @@ TEST(BSTMapCore, CopyConstructorDeepCopy) {
 }
 
 
-TEST(BSTMapAugmented, RemoveMinEmpty) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, RemoveMinEmpty) {
+  MapOf<TypeParam, int, string> bst;
   EXPECT_THROW(bst.remove_min(), runtime_error);
 }
 
-TEST(BSTMapAugmented, RemoveMinSingle) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, RemoveMinSingle) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   
   auto result = bst.remove_min();
@@ -206,8 +320,8 @@ TEST(BSTMapAugmented, RemoveMinSingle) {
   EXPECT_EQ(bst.size(), 0);
 }
 
-TEST(BSTMapAugmented, RemoveMinMultiple) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, RemoveMinMultiple) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -225,8 +339,8 @@ TEST(BSTMapAugmented, RemoveMinMultiple) {
   EXPECT_EQ(bst.size(), 2);
 }
 
-TEST(BSTMapAugmented, RemoveMinTreeStructure) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, RemoveMinTreeStructure) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -245,9 +359,9 @@ TEST(BSTMapAugmented, RemoveMinTreeStructure) {
   EXPECT_EQ(bst.at(3), "three");
 }
 
-TEST(BSTMapAugmented, OperatorEqualsBasic) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEqualsBasic) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
   
   map1.insert(1, "one");
   map1.insert(2, "two");
@@ -257,9 +371,9 @@ TEST(BSTMapAugmented, OperatorEqualsBasic) {
   EXPECT_TRUE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, OperatorEqualsDifferentValues) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEqualsDifferentValues) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
   
   map1.insert(1, "one");
   map1.insert(2, "two");
@@ -268,9 +382,9 @@ TEST(BSTMapAugmented, OperatorEqualsDifferentValues) {
   EXPECT_FALSE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, OperatorEqualsDifferentSizes) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEqualsDifferentSizes) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
   
   map1.insert(1, "one");
   map1.insert(2, "two");
@@ -278,22 +392,22 @@ TEST(BSTMapAugmented, OperatorEqualsDifferentSizes) {
   EXPECT_FALSE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, OperatorEqualsEmpty) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEqualsEmpty) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
   EXPECT_TRUE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, BeginEmpty) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, BeginEmpty) {
+  MapOf<TypeParam, int, string> bst;
   bst.begin();
   int key;
   string val;
   EXPECT_FALSE(bst.next(key, val));
 }
 
-TEST(BSTMapAugmented, BeginNextBasic) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, BeginNextBasic) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -328,8 +442,8 @@ TEST(BSTMapAugmented, BeginNextBasic) {
   EXPECT_FALSE(bst.next(key, val));
 }
 
-TEST(BSTMapAugmented, BeginNextSingle) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, BeginNextSingle) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   
   bst.begin();
@@ -343,8 +457,8 @@ TEST(BSTMapAugmented, BeginNextSingle) {
   EXPECT_FALSE(bst.next(key, val));
 }
 
-TEST(BSTMapAugmented, NextAfterEnd) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapAugmented, NextAfterEnd) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(1, "one");
   
   bst.begin();
@@ -356,8 +470,8 @@ TEST(BSTMapAugmented, NextAfterEnd) {
   EXPECT_FALSE(bst.next(key, val));  
 }
 
-TEST(BSTMapAugmented, BeginNextAllElements) {
-  BSTMap<int, int> bst;
+TYPED_TEST(BSTMapAugmented, BeginNextAllElements) {
+  MapOf<TypeParam, int, int> bst;
   vector<int> keys = {5, 3, 7, 1, 4, 6, 8};
   
   for (int key : keys) {
@@ -379,16 +493,16 @@ TEST(BSTMapAugmented, BeginNextAllElements) {
     EXPECT_LT(traversed[i-1], traversed[i]);
   }
 }
-TEST(BSTMapErase, EraseNotFoundgood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseNotFoundgood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   
   EXPECT_THROW(bst.erase(10), out_of_range);
   EXPECT_EQ(bst.size(), 1);
 }
 
-TEST(BSTMapErase, EraseLeafgood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseLeafgood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -401,8 +515,8 @@ TEST(BSTMapErase, EraseLeafgood) {
   EXPECT_TRUE(bst.contains(7));
 }
 
-TEST(BSTMapErase, EraseOneChildgood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseOneChildgood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(2, "two");
@@ -415,8 +529,8 @@ TEST(BSTMapErase, EraseOneChildgood) {
   EXPECT_TRUE(bst.contains(5));
 }
 
-TEST(BSTMapErase, EraseTwoChildrengood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseTwoChildrengood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -433,8 +547,8 @@ TEST(BSTMapErase, EraseTwoChildrengood) {
   EXPECT_TRUE(bst.contains(3));
 }
 
-TEST(BSTMapErase, EraseRootAlonegood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseRootAlonegood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   
   string result = bst.erase(5);
@@ -443,8 +557,8 @@ TEST(BSTMapErase, EraseRootAlonegood) {
   EXPECT_EQ(bst.size(), 0);
 }
 
-TEST(BSTMapErase, EraseRootWithChildrengood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseRootWithChildrengood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -457,8 +571,8 @@ TEST(BSTMapErase, EraseRootWithChildrengood) {
   EXPECT_TRUE(bst.contains(7));
 }
 
-TEST(BSTMapErase, EraseMultiplegood) {
-  BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, EraseMultiplegood) {
+  MapOf<TypeParam, int, string> bst;
   bst.insert(5, "five");
   bst.insert(3, "three");
   bst.insert(7, "seven");
@@ -481,9 +595,9 @@ TEST(BSTMapErase, EraseMultiplegood) {
   EXPECT_TRUE(bst.contains(8));
 }
 
-TEST(BSTMapAugmented, OperatorEquals3) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEquals3) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
 
   map1.insert(5, "five");
   map1.insert(3, "three");
@@ -505,9 +619,9 @@ TEST(BSTMapAugmented, OperatorEquals3) {
   EXPECT_TRUE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, OperatorEquals1) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEquals1) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
   
 
   map1.insert(1, "one");
@@ -520,9 +634,9 @@ TEST(BSTMapAugmented, OperatorEquals1) {
   EXPECT_FALSE(map1 == map2);
 }
 
-TEST(BSTMapAugmented, OperatorEquals2) {
-  BSTMap<int, string> map1;
-  BSTMap<int, string> map2;
+TYPED_TEST(BSTMapAugmented, OperatorEquals2) {
+  MapOf<TypeParam, int, string> map1;
+  MapOf<TypeParam, int, string> map2;
 
   map1.insert(2, "two");
   map1.insert(2, "two"); 
@@ -533,8 +647,8 @@ TEST(BSTMapAugmented, OperatorEquals2) {
   EXPECT_FALSE(map1 == map2);
 }
 
-TEST(BSTMapErase, SuccessorChildren1) {
-    BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, SuccessorChildren1) {
+    MapOf<TypeParam, int, string> bst;
     bst.insert(10, "ten");
     bst.insert(5, "five");
     bst.insert(15, "fifteen");
@@ -570,8 +684,8 @@ TEST(BSTMapErase, SuccessorChildren1) {
     EXPECT_EQ(count, 6);
 }
 
-TEST(BSTMapErase, SuccessorChild2) {
-    BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, SuccessorChild2) {
+    MapOf<TypeParam, int, string> bst;
     bst.insert(10, "ten");
     bst.insert(5, "five");
     bst.insert(20, "twenty");
@@ -607,8 +721,8 @@ TEST(BSTMapErase, SuccessorChild2) {
     EXPECT_EQ(count, 6);
 }
 
-TEST(BSTMapErase, SuccessorChild3) {
-    BSTMap<int, string> bst;
+TYPED_TEST(BSTMapErase, SuccessorChild3) {
+    MapOf<TypeParam, int, string> bst;
     bst.insert(10, "ten");
     bst.insert(5, "five");
     bst.insert(15, "fifteen");
@@ -640,4 +754,2029 @@ TEST(BSTMapErase, SuccessorChild3) {
     }
     EXPECT_EQ(count, 7);
 }
+
+TEST(BSTMapBalanced, SortedInsertStaysShallow) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 100000; i++) {
+    bst.insert(i, i * 2);
+  }
+
+  EXPECT_EQ(bst.size(), 100000);
+  EXPECT_LE(bst.height(), 25);
+  EXPECT_EQ(bst.at(0), 0);
+  EXPECT_EQ(bst.at(99999), 199998);
+}
+
+TEST(BSTMapBalanced, RandomInsertEraseMatchesPlain) {
+  BSTMap<int, int, AVLBalance> avl;
+  BSTMap<int, int> plain;
+  Random::seed(42);
+
+  for (int i = 0; i < 5000; i++) {
+    int key = Random::randInt(2000);
+    if (Random::randInt(3) == 0 && plain.contains(key)) {
+      EXPECT_EQ(avl.erase(key), plain.erase(key));
+    } else {
+      avl.insert(key, i);
+      plain.insert(key, i);
+    }
+    ASSERT_EQ(avl.size(), plain.size());
+  }
+
+  EXPECT_EQ(avl.to_string(), plain.to_string());
+  EXPECT_LE(avl.height(), 16);
+}
+
+TEST(BSTMapBalanced, RemoveMinRebalances) {
+  BSTMap<int, string, AVLBalance> bst;
+  for (int i = 0; i < 1000; i++) {
+    bst.insert(i, std::to_string(i));
+  }
+
+  for (int i = 0; i < 900; i++) {
+    auto result = bst.remove_min();
+    EXPECT_EQ(result.first, i);
+  }
+  EXPECT_EQ(bst.size(), 100);
+  EXPECT_LE(bst.height(), 9);
+}
+
+TEST(BSTMapBalanced, CopyKeepsBalance) {
+  BSTMap<int, int, AVLBalance> original;
+  for (int i = 0; i < 1000; i++) {
+    original.insert(i, i);
+  }
+
+  BSTMap<int, int, AVLBalance> copy(original);
+  EXPECT_EQ(copy.height(), original.height());
+  copy.erase(500);
+  copy.insert(1000, 1000);
+  EXPECT_TRUE(original.contains(500));
+  EXPECT_LE(copy.height(), 12);
+}
+
+// Runs body on a thread with a 256 KiB stack, so that recursing once per
+// level of a degenerate tree overflows it even with a few thousand keys.
+void runOnSmallStack(function<void()> body) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  pthread_t thread;
+  auto run = [](void* arg) -> void* {
+    (*static_cast<function<void()>*>(arg))();
+    return nullptr;
+  };
+  int created = pthread_create(&thread, &attr, run, &body);
+  pthread_attr_destroy(&attr);
+  ASSERT_EQ(created, 0);
+  pthread_join(thread, nullptr);
+}
+
+TEST(BSTMapDeep, DegenerateTreeDoesNotOverflowStack) {
+  // Both spines, so no walk gets away with a tail call on the deep side.
+  for (bool ascending : {true, false}) {
+    BSTMap<int, int> bst;
+    for (int i = 0; i < 20000; i++) {
+      int key = ascending ? i : -i;
+      bst.insert(key, key);
+    }
+    EXPECT_EQ(bst.height(), 20000);
+
+    runOnSmallStack([&] {
+      BSTMap<int, int> copy(bst);
+      EXPECT_EQ(copy.size(), 20000);
+      EXPECT_EQ(copy.to_string().size(), bst.to_string().size());
+
+      copy.clear();
+      EXPECT_TRUE(copy.empty());
+      bst.clear();
+    });
+    EXPECT_TRUE(bst.empty());
+  }
+}
+
+TEST(BSTMapAllocator, PoolRecyclesFreedSlots) {
+  NodePool<long> pool;
+  long* a = pool.allocate(1);
+  long* b = pool.allocate(1);
+  EXPECT_NE(a, b);
+
+  pool.deallocate(a, 1);
+  EXPECT_EQ(pool.allocate(1), a);
+  EXPECT_EQ(pool.capacity(), 16);
+  pool.deallocate(a, 1);
+  pool.deallocate(b, 1);
+}
+
+TEST(BSTMapAllocator, EraseThenInsertReusesNodes) {
+  BSTMap<int, string> bst;
+  for (int i = 0; i < 100; i++) {
+    bst.insert(i, "value");
+  }
+  size_t reserved = bst.get_allocator().capacity();
+
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 50; i++) {
+      bst.erase(i * 2);
+    }
+    for (int i = 0; i < 50; i++) {
+      bst.insert(i * 2, "again");
+    }
+  }
+  EXPECT_EQ(bst.size(), 100);
+  EXPECT_EQ(bst.get_allocator().capacity(), reserved);
+}
+
+TEST(BSTMapAllocator, ClearReleasesChunks) {
+  BSTMap<int, int, AVLBalance> ints;
+  BSTMap<int, string> strings;
+  for (int i = 0; i < 1000; i++) {
+    ints.insert(i, i);
+    strings.insert(i, std::to_string(i));
+  }
+  EXPECT_GE(ints.get_allocator().capacity(), 1000);
+
+  ints.clear();
+  strings.clear();
+  EXPECT_EQ(ints.get_allocator().capacity(), 0);
+  EXPECT_EQ(strings.get_allocator().capacity(), 0);
+
+  ints.insert(1, 1);
+  EXPECT_EQ(ints.at(1), 1);
+}
+
+struct alignas(64) WideKey {
+  int id;
+  auto operator<=>(const WideKey&) const = default;
+};
+
+// Nodes the pool hands to operator new must still be aligned, and clear()
+// must free them itself (LeakSanitizer checks the latter in the ASan build).
+TEST(BSTMapAllocator, OverAlignedNodesAreAlignedAndFreed) {
+  NodePool<WideKey> pool;
+  WideKey* single = pool.allocate(1);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(single) % 64, 0);
+  pool.deallocate(single, 1);
+
+  BSTMap<WideKey, int> bst;
+  for (int i = 0; i < 1000; i++) bst.insert(WideKey{i}, i);
+  for (auto it = bst.begin(); it != bst.end(); ++it) {
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(&it->first) % 64, 0) << it->first.id;
+  }
+  bst.clear();
+  EXPECT_TRUE(bst.empty());
+  bst.insert(WideKey{1}, 1);
+  EXPECT_EQ(bst.at(WideKey{1}), 1);
+}
+
+TEST(BSTMapAllocator, ClearFreesNodesThePoolSlotsDoNotFit) {
+  // The pool's slot size is fixed for longs before the map gets it, and
+  // the map ends up its only owner.
+  auto makeMap = [] {
+    NodePool<long> longs;
+    longs.deallocate(longs.allocate(1), 1);
+    return BSTMap<int, int>(NodePool<pair<const int, int>>(longs));
+  };
+  BSTMap<int, int> bst = makeMap();
+  for (int i = 0; i < 1000; i++) bst.insert(i, i);
+  bst.clear();
+  EXPECT_TRUE(bst.empty());
+  for (int i = 0; i < 10; i++) bst.insert(i, i);
+}
+
+TEST(BSTMapAllocator, CopyGetsItsOwnPool) {
+  BSTMap<int, int> original;
+  for (int i = 0; i < 100; i++) {
+    original.insert(i, i);
+  }
+
+  BSTMap<int, int> copy(original);
+  EXPECT_FALSE(copy.get_allocator() == original.get_allocator());
+  original.clear();
+  EXPECT_EQ(copy.size(), 100);
+  EXPECT_EQ(copy.at(99), 99);
+}
+
+TEST(BSTMapAllocator, CustomAllocatorSeesEveryNode) {
+  using Alloc = CountingAllocator<pair<const int, string>>;
+  AllocCounts counts;
+  {
+    BSTMap<int, string, AVLBalance, Alloc> bst{Alloc(&counts)};
+    for (int i = 0; i < 20; i++) {
+      bst.insert(i, "x");
+    }
+    bst.erase(3);
+    bst.remove_min();
+    BSTMap<int, string, AVLBalance, Alloc> copy(bst);
+    EXPECT_EQ(counts.allocs, 38);
+    EXPECT_EQ(counts.frees, 2);
+  }
+  EXPECT_EQ(counts.allocs, counts.frees);
+}
+
+TEST(BSTMapMove, MoveConstructorStealsNodes) {
+  BSTMap<int, string> original;
+  for (int i = 0; i < 100; i++) {
+    original.insert(i, std::to_string(i));
+  }
+  void* root = original.getRoot();
+
+  BSTMap<int, string> moved(std::move(original));
+  EXPECT_EQ(moved.getRoot(), root);
+  EXPECT_EQ(moved.size(), 100);
+  EXPECT_EQ(moved.at(42), "42");
+  EXPECT_TRUE(original.empty());
+
+  original.insert(1, "reused");
+  EXPECT_EQ(original.at(1), "reused");
+}
+
+TEST(BSTMapMove, MoveAssignmentReplacesContents) {
+  BSTMap<int, string, AVLBalance> source;
+  source.insert(1, "one");
+  source.insert(2, "two");
+  BSTMap<int, string, AVLBalance> target;
+  target.insert(9, "nine");
+
+  target = std::move(source);
+  EXPECT_EQ(target.size(), 2);
+  EXPECT_FALSE(target.contains(9));
+  EXPECT_EQ(target.at(2), "two");
+  EXPECT_TRUE(source.empty());
+}
+
+TEST(BSTMapMove, InsertRvaluesDoesNotCopy) {
+  BSTMap<int, CopyCounter> bst;
+  CopyCounter::copies = 0;
+  for (int i = 0; i < 10; i++) {
+    bst.insert(int(i), CopyCounter(i));
+  }
+  bst.erase(5);
+  bst.erase(3);
+  auto result = bst.remove_min();
+
+  EXPECT_EQ(result.second.id, 0);
+  EXPECT_EQ(bst.size(), 7);
+  EXPECT_EQ(CopyCounter::copies, 0);
+
+  // A copied key does not force a copy of a moved value, and vice versa.
+  int key = 20;
+  CopyCounter value(20);
+  bst.insert(key, std::move(value));
+  EXPECT_EQ(CopyCounter::copies, 0);
+  CopyCounter kept(21);
+  bst.insert(21, kept);
+  EXPECT_EQ(CopyCounter::copies, 1);
+  EXPECT_EQ(bst.at(20).id, 20);
+
+  BSTMap<string, CopyCounter> named;
+  string name = "a";
+  named.insert(name, CopyCounter(1));
+  named.insert("b", CopyCounter(2));  // converted to the key type
+  EXPECT_EQ(CopyCounter::copies, 1);
+  EXPECT_EQ(named.at("b").id, 2);
+
+  string late = "az";
+  CopyCounter fresh(20);
+  auto hinted = named.insert(named.end(), late, std::move(fresh));
+  hinted = named.insert(hinted, "c", CopyCounter(3));
+  EXPECT_EQ(CopyCounter::copies, 1);
+  EXPECT_EQ(hinted->second.id, 3);
+  EXPECT_EQ(named.at("az").id, 20);
+}
+
+TEST(BSTMapMove, TryEmplaceSkipsExistingKey) {
+  BSTMap<string, CopyCounter> bst;
+  CopyCounter::constructions = 0;
+
+  EXPECT_TRUE(bst.try_emplace("a", 1).second);
+  EXPECT_FALSE(bst.try_emplace("a", 2).second);
+  EXPECT_EQ(CopyCounter::constructions, 1);
+  EXPECT_EQ(bst.at("a").id, 1);
+}
+
+TEST(BSTMapMove, EmplaceBuildsInPlace) {
+  BSTMap<int, string> bst;
+  EXPECT_TRUE(bst.emplace(1, 3, 'x').second);
+  EXPECT_TRUE(bst.emplace(2, "two").second);
+  EXPECT_FALSE(bst.emplace(1, "dup").second);
+
+  EXPECT_EQ(bst.size(), 2);
+  EXPECT_EQ(bst.at(1), "xxx");
+}
+
+TEST(BSTMapMove, MoveOnlyValues) {
+  BSTMap<int, unique_ptr<int>, AVLBalance> bst;
+  for (int i = 0; i < 10; i++) {
+    bst.try_emplace(i, make_unique<int>(i * i));
+  }
+  bst.insert(10, make_unique<int>(100));
+
+  unique_ptr<int> erased = bst.erase(4);
+  EXPECT_EQ(*erased, 16);
+  EXPECT_EQ(*bst.remove_min().second, 0);
+  EXPECT_EQ(*bst.at(10), 100);
+
+  BSTMap<int, unique_ptr<int>, AVLBalance> moved(std::move(bst));
+  EXPECT_EQ(moved.size(), 9);
+}
+
+TEST(BSTMapBulkLoad, ConstructFromSortedRange) {
+  vector<pair<int, string>> entries;
+  for (int i = 0; i < 1000; i++) {
+    entries.push_back({i * 2, std::to_string(i)});
+  }
+
+  BSTMap<int, string> bst(entries.begin(), entries.end());
+  EXPECT_EQ(bst.size(), 1000);
+  EXPECT_EQ(bst.height(), 10);
+  EXPECT_EQ(bst.at(0), "0");
+  EXPECT_EQ(bst.at(1998), "999");
+  EXPECT_FALSE(bst.contains(1));
+
+  bst.begin();
+  int key;
+  string val;
+  int count = 0;
+  while (bst.next(key, val)) {
+    EXPECT_EQ(key, count * 2);
+    count++;
+  }
+  EXPECT_EQ(count, 1000);
+}
+
+TEST(BSTMapBulkLoad, AssignSortedReplacesAndStaysBalanced) {
+  BSTMap<int, int, AVLBalance> bst;
+  bst.insert(-1, -1);
+
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 777; i++) {
+    entries.push_back({i, i});
+  }
+  bst.assign_sorted(entries.begin(), entries.end());
+
+  EXPECT_EQ(bst.size(), 777);
+  EXPECT_FALSE(bst.contains(-1));
+  for (int i = 0; i < 700; i++) {
+    bst.erase(i);
+  }
+  bst.insert(1000, 1000);
+  EXPECT_EQ(bst.size(), 78);
+  EXPECT_LE(bst.height(), 8);
+  EXPECT_EQ(bst.remove_min().first, 700);
+}
+
+TEST(BSTMapBulkLoad, UnsortedInputThrows) {
+  vector<pair<int, string>> entries = {{1, "one"}, {3, "three"}, {2, "two"}};
+  BSTMap<int, string> bst;
+  bst.insert(7, "seven");
+
+  EXPECT_THROW(bst.assign_sorted(entries.begin(), entries.end()), invalid_argument);
+  EXPECT_TRUE(bst.empty());
+
+  vector<pair<int, string>> duplicates = {{1, "one"}, {1, "uno"}};
+  using Map = BSTMap<int, string>;
+  EXPECT_THROW(Map(duplicates.begin(), duplicates.end()), invalid_argument);
+}
+
+TEST(BSTMapBulkLoad, EmptyRange) {
+  vector<pair<int, int>> entries;
+  BSTMap<int, int> bst(entries.begin(), entries.end());
+  EXPECT_TRUE(bst.empty());
+  EXPECT_EQ(bst.getRoot(), nullptr);
+}
+
+TEST(BSTMapIterator, RangeForVisitsInOrder) {
+  BSTMap<int, string> bst;
+  bst.insert(5, "five");
+  bst.insert(3, "three");
+  bst.insert(7, "seven");
+  bst.insert(1, "one");
+
+  vector<int> keys;
+  for (auto [key, val] : bst) {
+    keys.push_back(key);
+    val += "!";
+  }
+  EXPECT_EQ(keys, vector<int>({1, 3, 5, 7}));
+  EXPECT_EQ(bst.at(3), "three!");
+}
+
+TEST(BSTMapIterator, ConstIterationAndArrow) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 10; i++) {
+    bst.insert(i, i * i);
+  }
+
+  const BSTMap<int, int, AVLBalance>& view = bst;
+  int sum = 0;
+  for (auto it = view.begin(); it != view.end(); ++it) {
+    sum += it->second;
+    EXPECT_EQ(it.key() * it.key(), it.value());
+  }
+  EXPECT_EQ(sum, 285);
+  EXPECT_EQ(distance(view.begin(), view.end()), 10);
+}
+
+TEST(BSTMapIterator, BackwardFromEnd) {
+  BSTMap<int, int> bst;
+  for (int key : {4, 2, 6, 1, 3, 5, 7}) {
+    bst.insert(key, key);
+  }
+
+  vector<int> keys;
+  auto it = bst.end();
+  while (it != bst.begin()) {
+    --it;
+    keys.push_back((*it).first);
+  }
+  EXPECT_EQ(keys, vector<int>({7, 6, 5, 4, 3, 2, 1}));
+  EXPECT_EQ(prev(bst.end())->first, 7);
+}
+
+TEST(BSTMapIterator, IndependentTraversals) {
+  BSTMap<int, int> bst;
+  for (int i = 0; i < 5; i++) {
+    bst.insert(i, i);
+  }
+
+  int pairs = 0;
+  for (auto [a, x] : bst) {
+    for (auto [b, y] : bst) {
+      if (a < b) pairs++;
+    }
+  }
+  EXPECT_EQ(pairs, 10);
+}
+
+TEST(BSTMapIterator, FindAndEraseByIterator) {
+  BSTMap<int, string> bst;
+  bst.insert(10, "ten");
+  bst.insert(5, "five");
+  bst.insert(15, "fifteen");
+  bst.insert(12, "twelve");
+  bst.insert(20, "twenty");
+
+  auto it = bst.find(15);
+  ASSERT_NE(it, bst.end());
+  EXPECT_EQ(it->second, "fifteen");
+  EXPECT_EQ(bst.find(11), bst.end());
+
+  it = bst.erase(it);
+  EXPECT_EQ(it->first, 20);
+  EXPECT_FALSE(bst.contains(15));
+
+  it = bst.erase(bst.find(20));
+  EXPECT_EQ(it, bst.end());
+  EXPECT_EQ(bst.size(), 3);
+}
+
+TEST(BSTMapIterator, EraseWhileIterating) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 100; i++) {
+    bst.insert(i, i);
+  }
+
+  for (auto it = bst.begin(); it != bst.end();) {
+    if (it->first % 3 == 0) it = bst.erase(it);
+    else ++it;
+  }
+  EXPECT_EQ(bst.size(), 66);
+  EXPECT_FALSE(bst.contains(99));
+  EXPECT_TRUE(bst.contains(98));
+  EXPECT_LE(bst.height(), 8);
+}
+
+TEST(BSTMapIterator, TryEmplaceReturnsIterator) {
+  BSTMap<string, int> bst;
+  auto [it, added] = bst.try_emplace("a", 1);
+  EXPECT_TRUE(added);
+  EXPECT_EQ(it->first, "a");
+
+  auto [again, added_again] = bst.try_emplace("a", 2);
+  EXPECT_FALSE(added_again);
+  EXPECT_EQ(again, it);
+  EXPECT_EQ(again->second, 1);
+}
+
+TEST(BSTMapIterator, RangeFeedsOtherContainers) {
+  BSTMap<int, string> bst;
+  bst.insert(2, "two");
+  bst.insert(1, "one");
+
+  vector<pair<int, string>> entries(bst.begin(), bst.end());
+  EXPECT_EQ(entries[0], make_pair(1, string("one")));
+
+  BSTMap<int, string, AVLBalance> rebuilt(bst.cbegin(), bst.cend());
+  EXPECT_EQ(rebuilt.to_string(), bst.to_string());
+}
+
+TEST(BSTMapCompare, EqualityIgnoresTreeShape) {
+  BSTMap<int, string, AVLBalance> balanced;
+  BSTMap<int, string, AVLBalance> other;
+  for (int i = 0; i < 100; i++) {
+    balanced.insert(i, std::to_string(i));
+    other.insert(99 - i, std::to_string(99 - i));
+  }
+  EXPECT_TRUE(balanced == other);
+
+  other.erase(50);
+  other.insert(50, "fifty");
+  EXPECT_FALSE(balanced == other);
+  EXPECT_TRUE(balanced != other);
+}
+
+TEST(BSTMapCompare, ThreeWayIsLexicographic) {
+  BSTMap<int, string> a;
+  BSTMap<int, string> b;
+  EXPECT_TRUE((a <=> b) == 0);
+
+  a.insert(1, "one");
+  b.insert(1, "one");
+  b.insert(2, "two");
+  EXPECT_TRUE(a < b);
+
+  a.insert(3, "three");
+  EXPECT_TRUE(a > b);
+  EXPECT_TRUE(b <= a);
+
+  b.erase(2);
+  b.insert(3, "zzz");
+  EXPECT_TRUE(a < b);
+  EXPECT_FALSE(a >= b);
+}
+
+TEST(BSTMapCompare, PartialOrderValues) {
+  BSTMap<int, double> a;
+  BSTMap<int, double> b;
+  a.insert(1, 1.0);
+  b.insert(1, 2.5);
+  EXPECT_TRUE(a < b);
+
+  b.erase(1);
+  b.insert(1, numeric_limits<double>::quiet_NaN());
+  EXPECT_FALSE(a < b);
+  EXPECT_FALSE(a > b);
+  EXPECT_FALSE(a == b);
+}
+
+TEST(BSTMapOrderStatistics, RankSelectMatchSortedKeys) {
+  BSTMap<int, int> bst;
+  vector<int> keys;
+  Random::seed(7);
+  for (int i = 0; i < 500; i++) {
+    int key = Random::randInt(10000);
+    if (!bst.contains(key)) keys.push_back(key);
+    bst.insert(key, i);
+  }
+  sort(keys.begin(), keys.end());
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(bst.rank(keys[i]), i);
+    EXPECT_EQ(bst.select(i)->first, keys[i]);
+    EXPECT_EQ(bst.kth(i), keys[i]);
+  }
+  EXPECT_EQ(bst.rank(-1), 0);
+  EXPECT_EQ(bst.rank(20000), keys.size());
+  EXPECT_EQ(bst.select(keys.size()), bst.end());
+  EXPECT_THROW(bst.kth(keys.size()), out_of_range);
+}
+
+TEST(BSTMapOrderStatistics, CountsSurviveMutation) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 1000; i++) {
+    bst.insert(i, i);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    bst.erase(i);
+  }
+  bst.remove_min();
+  bst.remove_min();
+
+  EXPECT_EQ(bst.size(), 498);
+  EXPECT_EQ(bst.kth(0), 5);
+  EXPECT_EQ(bst.rank(501), 248);
+  EXPECT_EQ(bst.select(497)->first, 999);
+
+  BSTMap<int, int, AVLBalance> copy(bst);
+  EXPECT_EQ(copy.rank(501), 248);
+}
+
+TEST(BSTMapOrderStatistics, CountRange) {
+  vector<pair<int, int>> entries;
+  for (int i = 0; i < 100; i++) {
+    entries.push_back({i * 10, i});
+  }
+  BSTMap<int, int> bst(entries.begin(), entries.end());
+
+  EXPECT_EQ(bst.count_range(0, 1000), 100);
+  EXPECT_EQ(bst.count_range(10, 50), 4);
+  EXPECT_EQ(bst.count_range(15, 51), 4);
+  EXPECT_EQ(bst.count_range(50, 10), 0);
+  EXPECT_EQ(bst.count_range(-100, 0), 0);
+  EXPECT_EQ(bst.kth(50), 500);
+}
+
+TEST(BSTMapRange, LowerAndUpperBound) {
+  BSTMap<int, string> bst;
+  for (int key : {10, 20, 30, 40}) {
+    bst.insert(key, std::to_string(key));
+  }
+
+  EXPECT_EQ(bst.lower_bound(20)->first, 20);
+  EXPECT_EQ(bst.upper_bound(20)->first, 30);
+  EXPECT_EQ(bst.lower_bound(21)->first, 30);
+  EXPECT_EQ(bst.lower_bound(5)->first, 10);
+  EXPECT_EQ(bst.lower_bound(41), bst.end());
+  EXPECT_EQ(bst.upper_bound(40), bst.end());
+
+  auto [first, last] = bst.equal_range(30);
+  EXPECT_EQ(first->first, 30);
+  EXPECT_EQ(last->first, 40);
+  auto missing = bst.equal_range(35);
+  EXPECT_EQ(missing.first, missing.second);
+}
+
+TEST(BSTMapRange, ForEachInRangeIsHalfOpen) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 100; i++) {
+    bst.insert(i, i);
+  }
+
+  vector<int> seen;
+  bst.for_each_in_range(10, 15, [&](const int& key, int& val) {
+    seen.push_back(key);
+    val = -val;
+  });
+  EXPECT_EQ(seen, vector<int>({10, 11, 12, 13, 14}));
+  EXPECT_EQ(bst.at(12), -12);
+  EXPECT_EQ(bst.at(15), 15);
+
+  const auto& view = bst;
+  int visits = 0;
+  view.for_each_in_range(200, 300, [&](const int&, const int&) { visits++; });
+  view.for_each_in_range(50, 50, [&](const int&, const int&) { visits++; });
+  EXPECT_EQ(visits, 0);
+}
+
+TEST(BSTMapRange, EraseRangeMatchesReference) {
+  Random::seed(11);
+  for (int round = 0; round < 50; round++) {
+    BSTMap<int, int, AVLBalance> avl;
+    BSTMap<int, int> plain;
+    for (int i = 0; i < 300; i++) {
+      int key = Random::randInt(1000);
+      avl.insert(key, key);
+      plain.insert(key, key);
+    }
+    int lo = Random::randInt(1000);
+    int hi = lo + Random::randInt(400);
+    size_t expected = avl.count_range(lo, hi);
+    size_t before = avl.size();
+
+    EXPECT_EQ(avl.erase_range(lo, hi), expected);
+    EXPECT_EQ(plain.erase_range(lo, hi), expected);
+    EXPECT_EQ(avl.size(), before - expected);
+    EXPECT_EQ(avl.count_range(lo, hi), 0);
+    EXPECT_EQ(avl.to_string(), plain.to_string());
+    EXPECT_LE(avl.height(), 12);
+
+    size_t rank = 0;
+    for (auto [key, val] : avl) {
+      EXPECT_EQ(avl.rank(key), rank++);
+      EXPECT_TRUE(key < lo || key >= hi);
+    }
+  }
+}
+
+TEST(BSTMapRange, EraseRangeEdges) {
+  BSTMap<int, string> bst;
+  for (int i = 1; i <= 10; i++) {
+    bst.insert(i, std::to_string(i));
+  }
+
+  EXPECT_EQ(bst.erase_range(5, 5), 0);
+  EXPECT_EQ(bst.erase_range(7, 3), 0);
+  EXPECT_EQ(bst.erase_range(11, 20), 0);
+  EXPECT_EQ(bst.erase_range(3, 6), 3);
+  EXPECT_EQ(bst.to_string(), "1: 1\n2: 2\n6: 6\n7: 7\n8: 8\n9: 9\n10: 10\n");
+
+  EXPECT_EQ(bst.erase_range(0, 100), 7);
+  EXPECT_TRUE(bst.empty());
+  bst.insert(4, "four");
+  EXPECT_EQ(bst.at(4), "four");
+}
+
+TEST(BTreeMap, RandomOpsMatchStdMap) {
+  BTreeMap<int, int, 16> tiny;
+  BTreeMap<int, int> wide;
+  map<int, int> reference;
+  Random::seed(5);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = Random::randInt(3000);
+    int op = Random::randInt(9);
+    if (op < 5) {
+      tiny.insert(key, i);
+      wide.insert(key, i);
+      reference.insert({key, i});
+    } else if (op < 8 && reference.count(key)) {
+      EXPECT_EQ(tiny.erase(key), reference[key]);
+      EXPECT_EQ(wide.erase(key), reference[key]);
+      reference.erase(key);
+    } else if (!reference.empty()) {
+      auto result = tiny.remove_min();
+      EXPECT_EQ(result.first, reference.begin()->first);
+      EXPECT_EQ(wide.remove_min(), result);
+      reference.erase(reference.begin());
+    }
+    ASSERT_EQ(tiny.size(), reference.size());
+  }
+
+  auto expected = reference.begin();
+  for (auto [key, val] : tiny) {
+    ASSERT_NE(expected, reference.end());
+    EXPECT_EQ(key, expected->first);
+    EXPECT_EQ(val, expected->second);
+    ++expected;
+  }
+  EXPECT_EQ(expected, reference.end());
+  EXPECT_EQ(wide.to_string(), tiny.to_string());
+}
+
+TEST(BTreeMap, WideNodesStayShallow) {
+  BTreeMap<int, int> bst;
+  for (int i = 0; i < 100000; i++) {
+    bst.insert(i, i);
+  }
+  EXPECT_LE(bst.height(), 5);
+  EXPECT_EQ(bst.at(77777), 77777);
+
+  for (int i = 0; i < 100000; i += 2) {
+    bst.erase(i);
+  }
+  EXPECT_EQ(bst.size(), 50000);
+  EXPECT_FALSE(bst.contains(77776));
+  EXPECT_TRUE(bst.contains(77777));
+}
+
+TEST(BTreeMap, IteratorsWalkBothWays) {
+  BTreeMap<int, string, 16> bst;
+  for (int i = 0; i < 50; i++) {
+    bst.insert(i, std::to_string(i));
+  }
+
+  int expected = 49;
+  for (auto it = bst.end(); it != bst.begin();) {
+    --it;
+    EXPECT_EQ(it->first, expected--);
+  }
+  EXPECT_EQ(expected, -1);
+
+  auto it = bst.find(20);
+  it->second = "twenty";
+  EXPECT_EQ(bst.at(20), "twenty");
+  EXPECT_EQ(bst.find(50), bst.end());
+}
+
+TEST(BTreeMap, CopyAndMoveAreIndependent) {
+  BTreeMap<int, string, 16> original;
+  for (int i = 0; i < 100; i++) {
+    original.insert(i, std::to_string(i));
+  }
+
+  BTreeMap<int, string, 16> copy(original);
+  EXPECT_TRUE(copy == original);
+  copy.erase(5);
+  EXPECT_FALSE(copy == original);
+  EXPECT_TRUE(original.contains(5));
+
+  BTreeMap<int, string, 16> moved(std::move(copy));
+  EXPECT_EQ(moved.size(), 99);
+  EXPECT_TRUE(copy.empty());
+
+  copy = moved;
+  EXPECT_TRUE(copy == moved);
+}
+
+TEST(CompactBSTMap, RandomOpsMatchStdMap) {
+  CompactBSTMap<int, int> bst;
+  map<int, int> reference;
+  Random::seed(31);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = Random::randInt(3000);
+    int op = Random::randInt(9);
+    if (op < 5) {
+      bst.insert(key, i);
+      reference.insert({key, i});
+    } else if (op < 8 && reference.count(key)) {
+      EXPECT_EQ(bst.erase(key), reference[key]);
+      reference.erase(key);
+    } else if (!reference.empty()) {
+      auto result = bst.remove_min();
+      EXPECT_EQ(result.first, reference.begin()->first);
+      EXPECT_EQ(result.second, reference.begin()->second);
+      reference.erase(reference.begin());
+    }
+    ASSERT_EQ(bst.size(), reference.size());
+  }
+  EXPECT_LE(bst.height(), 1.45 * log2(reference.size() + 2));
+
+  bst.begin();
+  int key, val;
+  for (auto [expectedKey, expectedVal] : reference) {
+    ASSERT_TRUE(bst.next(key, val));
+    EXPECT_EQ(key, expectedKey);
+    EXPECT_EQ(val, expectedVal);
+  }
+  EXPECT_FALSE(bst.next(key, val));
+}
+
+TEST(CompactBSTMap, NodesAreTwentyBytesAndErasedSlotsAreReused) {
+  CompactBSTMap<int, int> bst;
+  bst.reserve(100000);
+  for (int i = 0; i < 100000; i++) bst.insert(i, i);  // sorted input stays balanced
+  EXPECT_EQ(bst.memory_bytes(), 100000 * 20);
+  EXPECT_LE(bst.height(), 17);
+
+  for (int i = 0; i < 100000; i += 2) bst.erase(i);
+  for (int i = 0; i < 50000; i++) bst.insert(-i - 1, i);
+  EXPECT_EQ(bst.size(), 100000);
+  EXPECT_EQ(bst.memory_bytes(), 100000 * 20);
+  EXPECT_EQ(bst.at(-50000), 49999);
+  EXPECT_EQ(bst.at(99999), 99999);
+  EXPECT_FALSE(bst.contains(0));
+
+  bst.clear();
+  EXPECT_EQ(bst.memory_bytes(), 0);
+}
+
+TEST(CompactBSTMap, CopyAndMoveAreIndependent) {
+  CompactBSTMap<int, string> original;
+  for (int i = 0; i < 100; i++) {
+    original.insert(i, std::to_string(i));
+  }
+
+  CompactBSTMap<int, string> copy(original);
+  EXPECT_TRUE(copy == original);
+  copy.erase(5);
+  EXPECT_FALSE(copy == original);
+  EXPECT_TRUE(original.contains(5));
+
+  CompactBSTMap<int, string> moved(std::move(copy));
+  EXPECT_EQ(moved.size(), 99);
+  EXPECT_TRUE(copy.empty());
+  EXPECT_FALSE(copy.contains(1));
+
+  copy = moved;
+  copy.insert(5, "five");
+  EXPECT_EQ(copy.at(5), "five");
+  EXPECT_FALSE(moved.contains(5));
+}
+
+template <typename KeyT>
+class FrozenMapKeys : public ::testing::Test {};
+
+using FrozenKeyTypes = ::testing::Types<int, unsigned, int64_t, uint64_t, short, double>;
+TYPED_TEST_SUITE(FrozenMapKeys, FrozenKeyTypes);
+
+TYPED_TEST(FrozenMapKeys, LookupsMatchStdMapAcrossSizes) {
+  using KeyT = TypeParam;
+  // Keys span the type's extremes so the signed/unsigned lane compares are
+  // exercised; sizes leave the last search block partly padded.
+  for (size_t n : {0, 1, 2, 7, 15, 16, 17, 100, 1000, 4099}) {
+    map<KeyT, int> expected;
+    if (n > 0) expected[numeric_limits<KeyT>::lowest()] = -1;
+    if (n > 1) expected[numeric_limits<KeyT>::max()] = -2;
+    for (int i = 0; expected.size() < n; i++) {
+      expected[static_cast<KeyT>(3 * i + 1)] = i;
+    }
+
+    BSTMap<KeyT, int, AVLBalance> bst;
+    for (const auto& [key, value] : expected) bst.insert(key, value);
+    FrozenMap<KeyT, int> frozen = bst.freeze();
+    ASSERT_EQ(frozen.size(), n);
+
+    for (const auto& [key, value] : expected) {
+      const int* found = frozen.find(key);
+      ASSERT_NE(found, nullptr) << "n=" << n;
+      EXPECT_EQ(*found, value);
+    }
+    for (int i = 0; i < 3 * static_cast<int>(n) + 3; i += 3) {
+      KeyT miss = static_cast<KeyT>(i);
+      EXPECT_EQ(frozen.contains(miss), expected.count(miss) == 1) << "n=" << n << " i=" << i;
+    }
+
+    vector<pair<KeyT, int>> walked;
+    frozen.for_each([&](const KeyT& key, int value) { walked.emplace_back(key, value); });
+    EXPECT_EQ(walked, (vector<pair<KeyT, int>>(expected.begin(), expected.end())));
+  }
+}
+
+TEST(FrozenMap, StringKeysUseThePlainLayout) {
+  BSTMap<string, int> bst;
+  Random::seed(7);
+  for (int i = 0; i < 500; i++) {
+    bst.insert("key" + std::to_string(Random::randInt(10000)), i);
+  }
+  FrozenMap<string, int> frozen = bst.freeze();
+  EXPECT_EQ(frozen.size(), bst.size());
+  for (auto [key, value] : bst) {
+    EXPECT_EQ(frozen.at(key), value);
+  }
+  EXPECT_FALSE(frozen.contains("aaa"));
+  EXPECT_FALSE(frozen.contains("zzz"));
+  EXPECT_THROW(frozen.at("key-1"), out_of_range);
+}
+
+TEST(FrozenMap, RejectsUnsortedInput) {
+  vector<pair<int, int>> entries = {{1, 1}, {3, 3}, {2, 2}};
+  using Frozen = FrozenMap<int, int>;
+  EXPECT_THROW(Frozen(entries.begin(), entries.end()), invalid_argument);
+}
+
+TEST(FrozenMap, IsIndependentOfTheSourceMap) {
+  BSTMap<int, int> bst;
+  for (int i = 0; i < 100; i++) bst.insert(i, i * i);
+  FrozenMap<int, int> frozen = bst.freeze();
+  bst.clear();
+  EXPECT_EQ(frozen.at(9), 81);
+  EXPECT_LT(frozen.memory_bytes(), 100 * (2 * sizeof(int) + 3 * sizeof(void*)));
+}
+
+TEST(ConcurrentBSTMap, RandomOpsMatchStdMap) {
+  ConcurrentBSTMap<int, int> concurrent;
+  map<int, int> expected;
+  Random::seed(11);
+  for (int i = 0; i < 20000; i++) {
+    int key = Random::randInt(500);
+    if (Random::randInt(2)) {
+      concurrent.insert(key, i);
+      expected.emplace(key, i);
+    } else if (expected.count(key)) {
+      EXPECT_EQ(concurrent.erase(key), expected[key]);
+      expected.erase(key);
+    } else {
+      EXPECT_THROW(concurrent.erase(key), out_of_range);
+    }
+    ASSERT_EQ(concurrent.size(), expected.size());
+  }
+  for (int key = 0; key < 500; key++) {
+    ASSERT_EQ(concurrent.contains(key), expected.count(key) == 1);
+    if (expected.count(key)) {
+      EXPECT_EQ(concurrent.at(key), expected[key]);
+    }
+  }
+  concurrent.clear();
+  EXPECT_TRUE(concurrent.empty());
+  EXPECT_THROW(concurrent.at(1), out_of_range);
+}
+
+TEST(ConcurrentBSTMap, ReplacedNodesAreReclaimed) {
+  auto token = make_shared<int>(7);
+  {
+    ConcurrentBSTMap<int, shared_ptr<int>> concurrent;
+    concurrent.insert(0, token);
+    EXPECT_EQ(*concurrent.at(0), 7);
+    concurrent.erase(0);
+    // Enough later writes to trigger reclamation; no reader is active.
+    for (int i = 1; i < 1000; i++) concurrent.insert(i, nullptr);
+    EXPECT_EQ(token.use_count(), 1);
+
+    concurrent.insert(0, token);
+  }
+  EXPECT_EQ(token.use_count(), 1);
+}
+
+TEST(ConcurrentBSTMap, ReadersSeeConsistentTreesDuringWrites) {
+  // Even keys are always present; writers keep adding and removing odd
+  // ones. Readers must never miss an even key or see a torn value.
+  ConcurrentBSTMap<int, int> concurrent;
+  const int keys = 2000;
+  for (int key = 0; key < keys; key += 2) concurrent.insert(key, key * 10);
+
+  atomic<bool> stop{false};
+  atomic<int> failures{0};
+  vector<thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&, t] {
+      mt19937 rng(t);
+      while (!stop.load()) {
+        int key = rng() % keys;
+        if (key % 2 == 0) {
+          if (!concurrent.contains(key) || concurrent.at(key) != key * 10) failures++;
+        } else {
+          try {
+            if (concurrent.at(key) != key * 10) failures++;
+          } catch (const out_of_range&) {
+          }
+        }
+      }
+    });
+  }
+
+  thread writer([&] {
+    mt19937 rng(42);
+    for (int i = 0; i < 20000; i++) {
+      int key = (rng() % (keys / 2)) * 2 + 1;
+      if (concurrent.contains(key)) concurrent.erase(key);
+      else concurrent.insert(key, key * 10);
+    }
+    stop = true;
+  });
+
+  writer.join();
+  for (thread& reader : readers) reader.join();
+  EXPECT_EQ(failures.load(), 0);
+  for (int key = 0; key < keys; key += 2) EXPECT_TRUE(concurrent.contains(key));
+}
+
+TEST(ShardedBSTMap, RandomOpsMatchStdMap) {
+  ShardedBSTMap<int, int, 4> sharded;
+  map<int, int> expected;
+  Random::seed(12);
+  for (int i = 0; i < 5000; i++) {
+    int key = Random::randInt(300);
+    if (Random::randInt(3)) {
+      sharded.insert(key, i);
+      expected.emplace(key, i);
+    } else if (expected.count(key)) {
+      EXPECT_EQ(sharded.erase(key), expected[key]);
+      expected.erase(key);
+    } else {
+      EXPECT_THROW(sharded.erase(key), out_of_range);
+    }
+  }
+  EXPECT_EQ(sharded.size(), expected.size());
+
+  vector<pair<int, int>> walked;
+  sharded.for_each([&](int key, int value) { walked.emplace_back(key, value); });
+  EXPECT_EQ(walked, (vector<pair<int, int>>(expected.begin(), expected.end())));
+
+  sharded.clear();
+  EXPECT_TRUE(sharded.empty());
+  EXPECT_EQ(sharded.to_string(), "");
+}
+
+TEST(ShardedBSTMap, ToStringMatchesBSTMap) {
+  ShardedBSTMap<int, string> sharded;
+  BSTMap<int, string> bst;
+  for (int key : {42, 7, 19, 3, 88, 64, 1}) {
+    sharded.insert(key, "v" + std::to_string(key));
+    bst.insert(key, "v" + std::to_string(key));
+  }
+  EXPECT_EQ(sharded.to_string(), bst.to_string());
+  EXPECT_EQ(sharded.at(19), "v19");
+  EXPECT_THROW(sharded.at(20), out_of_range);
+}
+
+TEST(ShardedBSTMap, ParallelWritersKeepEveryKey) {
+  ShardedBSTMap<int, int, 8> sharded;
+  const int perThread = 5000;
+  vector<thread> writers;
+  for (int t = 0; t < 4; t++) {
+    writers.emplace_back([&, t] {
+      for (int i = 0; i < perThread; i++) sharded.insert(t * perThread + i, t);
+      for (int i = 0; i < perThread; i += 2) sharded.erase(t * perThread + i);
+    });
+  }
+  for (thread& writer : writers) writer.join();
+
+  EXPECT_EQ(sharded.size(), 4 * perThread / 2);
+  int expectedKey = 1;
+  sharded.for_each([&](int key, int value) {
+    EXPECT_EQ(key, expectedKey);
+    EXPECT_EQ(value, key / perThread);
+    expectedKey += 2;
+  });
+  EXPECT_EQ(expectedKey, 4 * perThread + 1);
+}
+
+TEST(PersistentBSTMap, SnapshotsKeepTheirVersion) {
+  PersistentBSTMap<int, int> live;
+  vector<PersistentBSTMap<int, int>> versions;
+  vector<map<int, int>> expected;
+  map<int, int> current;
+  Random::seed(13);
+  for (int i = 0; i < 3000; i++) {
+    int key = Random::randInt(200);
+    if (Random::randInt(3)) {
+      live.insert(key, i);
+      current.emplace(key, i);
+    } else if (current.count(key)) {
+      EXPECT_EQ(live.erase(key), current[key]);
+      current.erase(key);
+    }
+    if (i % 300 == 0) {
+      versions.push_back(live.snapshot());
+      expected.push_back(current);
+    }
+  }
+
+  for (size_t v = 0; v < versions.size(); v++) {
+    vector<pair<int, int>> walked;
+    versions[v].for_each([&](int key, int value) { walked.emplace_back(key, value); });
+    EXPECT_EQ(walked, (vector<pair<int, int>>(expected[v].begin(), expected[v].end()))) << "version " << v;
+    EXPECT_EQ(versions[v].size(), expected[v].size());
+  }
+  EXPECT_EQ(live.size(), current.size());
+  EXPECT_LE(live.height(), 12);
+}
+
+TEST(PersistentBSTMap, UpdatesCopyOnlyTheSearchPath) {
+  PersistentBSTMap<int, CopyCounter> original;
+  for (int i = 0; i < 1024; i++) original.insert(2 * i, CopyCounter(i));
+
+  CopyCounter::copies = 0;
+  PersistentBSTMap<int, CopyCounter> snapshot = original.snapshot();
+  EXPECT_EQ(CopyCounter::copies, 0);
+
+  original.insert(101, CopyCounter(-1));
+  original.erase(500);
+  EXPECT_LE(CopyCounter::copies, 2 * (original.height() + 3));
+  EXPECT_TRUE(snapshot.contains(500));
+  EXPECT_FALSE(snapshot.contains(101));
+  EXPECT_EQ(snapshot.at(500).id, 250);
+}
+
+TEST(PersistentBSTMap, SharedNodesAreFreedWithTheLastVersion) {
+  auto token = make_shared<int>(1);
+  {
+    PersistentBSTMap<int, shared_ptr<int>> first;
+    for (int i = 0; i < 50; i++) first.insert(i, token);
+    PersistentBSTMap<int, shared_ptr<int>> second = first;
+    second.erase(10);
+    first.clear();
+    EXPECT_EQ(token.use_count(), 50);
+  }
+  EXPECT_EQ(token.use_count(), 1);
+}
+
+TEST(PersistentBSTMap, SnapshotCanBeScannedWhileTheOriginalChanges) {
+  PersistentBSTMap<int, int> live;
+  for (int i = 0; i < 5000; i++) live.insert(i, i);
+  PersistentBSTMap<int, int> frozen = live.snapshot();
+
+  thread reader([&] {
+    for (int round = 0; round < 20; round++) {
+      long long sum = 0;
+      frozen.for_each([&](int, int value) { sum += value; });
+      EXPECT_EQ(sum, 5000LL * 4999 / 2);
+    }
+  });
+  for (int i = 0; i < 5000; i += 2) live.erase(i);
+  for (int i = 5000; i < 8000; i++) live.insert(i, i);
+  reader.join();
+  EXPECT_EQ(live.size(), 5500);
+  EXPECT_EQ(frozen.size(), 5000);
+}
+
+// Three-way comparator that counts its calls and whether it saw a key of
+// another type than the stored one.
+struct CountingThreeWay {
+  using is_transparent = void;
+  static int calls;
+  static int mixedCalls;
+
+  template <typename A, typename B>
+  auto operator()(const A& a, const B& b) const {
+    calls++;
+    if (!is_same_v<A, B>) mixedCalls++;
+    return SynthThreeWay{}(a, b);
+  }
+};
+
+int CountingThreeWay::calls = 0;
+int CountingThreeWay::mixedCalls = 0;
+
+TEST(BSTMapCompare, OneComparisonPerLevel) {
+  BSTMap<int, int, AVLBalance, NodePool<pair<const int, int>>, CountingThreeWay> bst;
+  for (int i = 0; i < 1024; i++) bst.insert(i, i);
+  for (int key : {0, 511, 777, 1023, 5000}) {
+    CountingThreeWay::calls = 0;
+    bst.contains(key);
+    EXPECT_LE(CountingThreeWay::calls, static_cast<int>(bst.height())) << key;
+  }
+}
+
+TEST(BSTMapCompare, CustomOrderingDrivesTheTree) {
+  using Descending = BSTMap<int, int, AVLBalance, NodePool<pair<const int, int>>, greater<int>>;
+  Descending bst;
+  for (int key : {5, 1, 9, 3, 7}) bst.insert(key, key * 10);
+  vector<int> keys;
+  for (auto [key, value] : bst) keys.push_back(key);
+  EXPECT_EQ(keys, (vector<int>{9, 7, 5, 3, 1}));
+  EXPECT_EQ(bst.lower_bound(6)->first, 5);
+  EXPECT_EQ(bst.rank(5), 2);
+  EXPECT_EQ(bst.count_range(9, 3), 3);
+  EXPECT_EQ(bst.erase(7), 70);
+  EXPECT_FALSE(bst.contains(7));
+
+  // Stateful three-way comparator: order by distance from a pivot.
+  auto byDistance = [pivot = 50](int a, int b) { return abs(a - pivot) <=> abs(b - pivot); };
+  BSTMap<int, int, NoBalance, NodePool<pair<const int, int>>, decltype(byDistance)> near(byDistance);
+  for (int key : {10, 48, 90, 53}) near.insert(key, key);
+  EXPECT_EQ(near.begin()->first, 48);
+  EXPECT_TRUE(near.contains(52));  // same distance as 48
+}
+
+TEST(BSTMapCompare, FreezeKeepsTheMapsOrdering) {
+  BSTMap<int, int, AVLBalance, NodePool<pair<const int, int>>, greater<int>> descending;
+  for (int i = 0; i < 1000; i++) descending.insert(i * 3, i);
+  auto frozen = descending.freeze();
+  EXPECT_EQ(frozen.size(), descending.size());
+  for (int key = -1; key < 3001; key++) {
+    EXPECT_EQ(frozen.contains(key), descending.contains(key)) << key;
+  }
+  vector<int> keys;
+  frozen.for_each([&](int key, int) { keys.push_back(key); });
+  EXPECT_EQ(keys.front(), 2997);
+  EXPECT_TRUE(is_sorted(keys.begin(), keys.end(), greater<int>()));
+
+  // A three-way comparator that disagrees with <.
+  auto byDistance = [pivot = 50](int a, int b) { return abs(a - pivot) <=> abs(b - pivot); };
+  BSTMap<int, int, NoBalance, NodePool<pair<const int, int>>, decltype(byDistance)> near(byDistance);
+  for (int key : {10, 48, 90, 53, 50}) near.insert(key, key);
+  auto nearFrozen = near.freeze();
+  EXPECT_EQ(nearFrozen.at(48), 48);
+  EXPECT_EQ(nearFrozen.at(52), 48);  // same distance as 48
+  EXPECT_FALSE(nearFrozen.contains(20));
+}
+
+TEST(BSTMapCompare, HeterogeneousLookupSkipsTemporaryKeys) {
+  BSTMap<string, int, AVLBalance, NodePool<pair<const string, int>>, CountingThreeWay> bst;
+  for (string key : {"apple", "banana", "cherry"}) bst.insert(key, 1);
+
+  CountingThreeWay::mixedCalls = 0;
+  EXPECT_TRUE(bst.contains("banana"));
+  EXPECT_FALSE(bst.contains(string_view("durian")));
+  EXPECT_EQ(bst.find("cherry")->first, "cherry");
+  EXPECT_EQ(bst.lower_bound("b")->first, "banana");
+  EXPECT_EQ(bst.at("apple"), 1);
+  EXPECT_GT(CountingThreeWay::mixedCalls, 0);
+
+  BSTMap<string, int> plain;
+  plain.insert("key", 7);
+  EXPECT_EQ(plain.at("key"), 7);
+  EXPECT_EQ(plain.upper_bound(string_view("k"))->first, "key");
+}
+
+TEST(BSTMapBatch, FindBatchMatchesAt) {
+  BSTMap<int, int, AVLBalance> bst;
+  for (int i = 0; i < 1000; i += 3) bst.insert(i, i * 2);
+
+  vector<int> keys;
+  for (int i = 0; i < 1000; i += 7) keys.push_back(i);  // more than one group, ragged tail
+  vector<int*> out(keys.size());
+  bst.find_batch(keys, out);
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (keys[i] % 3 == 0) {
+      ASSERT_NE(out[i], nullptr);
+      EXPECT_EQ(*out[i], keys[i] * 2);
+    } else {
+      EXPECT_EQ(out[i], nullptr);
+    }
+  }
+
+  *out[0] = -1;
+  EXPECT_EQ(bst.at(0), -1);
+
+  vector<int*> tooShort(1);
+  EXPECT_THROW(bst.find_batch(keys, tooShort), invalid_argument);
+
+  BSTMap<int, int> empty;
+  empty.find_batch(keys, out);
+  EXPECT_EQ(count(out.begin(), out.end(), nullptr), static_cast<long>(keys.size()));
+}
+
+TEST(BSTMapBatch, InsertBatchKeepsExistingValues) {
+  BSTMap<int, string, AVLBalance> bst;
+  bst.insert(5, "old");
+  vector<int> keys = {1, 5, 9, 1, 40, 3, 22, 17, 8, 6, 30, 31, 32, 33, 34, 35, 36, 37, 38};
+  vector<string> values;
+  for (int key : keys) values.push_back("v" + std::to_string(key));
+
+  EXPECT_EQ(bst.insert_batch(keys, values), keys.size() - 2);
+  EXPECT_EQ(bst.size(), keys.size() - 1);
+  EXPECT_EQ(bst.at(5), "old");
+  EXPECT_EQ(bst.at(38), "v38");
+  EXPECT_LE(bst.height(), 6);
+}
+
+template <typename Balance>
+class BSTMapSetAlgebra : public ::testing::Test {};
+
+using BalancePolicies = ::testing::Types<NoBalance, AVLBalance, SplayBalance>;
+TYPED_TEST_SUITE(BSTMapSetAlgebra, BalancePolicies);
+
+template <typename Map>
+vector<pair<int, int>> entriesOf(const Map& map) {
+  vector<pair<int, int>> entries;
+  for (auto [key, value] : map) entries.emplace_back(key, value);
+  return entries;
+}
+
+// Random keys in [0, range) with value = key * scale + tag.
+template <typename Balance>
+BSTMap<int, int, Balance> randomMap(int count, int range, int tag, const NodePool<pair<const int, int>>& pool) {
+  BSTMap<int, int, Balance> map(pool);
+  for (int i = 0; i < count; i++) {
+    int key = Random::randInt(range);
+    map.insert(key, key * 10 + tag);
+  }
+  return map;
+}
+
+TYPED_TEST(BSTMapSetAlgebra, SplitAndJoinRelinkNodes) {
+  using Map = BSTMap<int, CopyCounter, TypeParam>;
+  Map map;
+  for (int i = 0; i < 200; i++) map.insert(i, CopyCounter(i));
+  CopyCounter::copies = 0;
+
+  Map upper = map.split(120);
+  EXPECT_EQ(map.size(), 120);
+  EXPECT_EQ(upper.size(), 80);
+  EXPECT_EQ((--map.end())->first, 119);
+  EXPECT_EQ(upper.begin()->first, 120);
+  EXPECT_EQ(upper.rank(150), 30);
+
+  Map empty = upper.split(1000);
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(upper.size(), 80);
+
+  Map joined = Map::join(std::move(map), std::move(upper));
+  EXPECT_EQ(joined.size(), 200);
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(upper.empty());
+  EXPECT_EQ(CopyCounter::copies, 0);
+  int expected = 0;
+  for (auto [key, value] : joined) {
+    EXPECT_EQ(key, expected);
+    EXPECT_EQ(value.id, expected++);
+  }
+  if constexpr (is_same_v<TypeParam, AVLBalance>) {
+    EXPECT_LE(joined.height(), 10);
+  }
+
+  Map low;
+  low.insert(500, CopyCounter(0));
+  Map high = joined.split(100);
+  EXPECT_THROW(Map::join(std::move(low), std::move(high)), invalid_argument);
+}
+
+TYPED_TEST(BSTMapSetAlgebra, OperationsMatchStdAlgorithms) {
+  using Map = BSTMap<int, int, TypeParam>;
+  Random::seed(16);
+  NodePool<pair<const int, int>> shared;
+  NodePool<pair<const int, int>> separate;
+  // Big enough that the top levels run their halves on two threads.
+  for (int count : {0, 1, 50, 40000}) {
+    Map base = randomMap<TypeParam>(count, 3 * count + 1, 1, shared);
+    Map other = randomMap<TypeParam>(count / 2 + 3, 3 * count + 1, 2, separate);
+    auto a = entriesOf(base);
+    auto b = entriesOf(other);
+    auto byKey = [](const pair<int, int>& x, const pair<int, int>& y) { return x.first < y.first; };
+
+    vector<pair<int, int>> expected;
+    set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected), byKey);
+    Map unioned(base);
+    unioned.union_with(other);
+    EXPECT_EQ(entriesOf(unioned), expected) << count;
+    EXPECT_EQ(unioned.size(), expected.size());
+
+    Map movedIn(base);
+    movedIn.union_with(Map(other));
+    EXPECT_EQ(entriesOf(movedIn), expected) << count;
+
+    expected.clear();
+    set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected), byKey);
+    Map intersected(base);
+    intersected.intersect_with(other);
+    EXPECT_EQ(entriesOf(intersected), expected) << count;
+    EXPECT_EQ(intersected.size(), expected.size());
+
+    expected.clear();
+    set_difference(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected), byKey);
+    Map differed(base);
+    differed.difference_with(other);
+    EXPECT_EQ(entriesOf(differed), expected) << count;
+    EXPECT_EQ(differed.size(), expected.size());
+
+    if constexpr (is_same_v<TypeParam, AVLBalance>) {
+      for (const Map* result : {&unioned, &intersected, &differed}) {
+        EXPECT_LE(result->height(), 1.45 * log2(result->size() + 2) + 1);
+      }
+    }
+  }
+}
+
+TYPED_TEST(BSTMapSetAlgebra, DegenerateInputsDoNotOverflowStack) {
+  using Map = BSTMap<int, int, TypeParam>;
+  // Sorted inserts leave a plain or splay tree one long spine each way.
+  Map ascending;
+  Map descending;
+  for (int i = 0; i < 5000; i++) {
+    ascending.insert(i, i);
+    descending.insert(2 * (4999 - i), -i);
+  }
+  auto a = entriesOf(ascending);
+  auto b = entriesOf(descending);
+  auto byKey = [](const pair<int, int>& x, const pair<int, int>& y) { return x.first < y.first; };
+
+  runOnSmallStack([&] {
+    vector<pair<int, int>> expected;
+    set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected), byKey);
+    Map unioned(ascending);
+    unioned.union_with(descending);
+    EXPECT_EQ(entriesOf(unioned), expected);
+    Map movedIn(descending);
+    movedIn.union_with(Map(ascending));
+    EXPECT_EQ(movedIn.size(), expected.size());
+    EXPECT_EQ(movedIn.peek_max().first, 9998);
+
+    expected.clear();
+    set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(expected), byKey);
+    Map intersected(ascending);
+    intersected.intersect_with(descending);
+    EXPECT_EQ(entriesOf(intersected), expected);
+    EXPECT_EQ(intersected.peek_min().first, 0);
+
+    expected.clear();
+    set_difference(b.begin(), b.end(), a.begin(), a.end(), back_inserter(expected), byKey);
+    Map differed(descending);
+    differed.difference_with(ascending);
+    EXPECT_EQ(entriesOf(differed), expected);
+    EXPECT_EQ(differed.peek_min().first, 5000);
+
+    // The results come back balanced whatever the policy.
+    for (const Map* result : {&unioned, &movedIn, &intersected, &differed}) {
+      EXPECT_LE(result->height(), 1.45 * log2(result->size() + 2) + 1);
+    }
+  });
+}
+
+TEST(BSTMapSetAlgebra, UnionWithSharedAllocatorMovesNodes) {
+  BSTMap<int, CopyCounter, AVLBalance> left;
+  for (int i = 0; i < 100; i += 2) left.insert(i, CopyCounter(i));
+  BSTMap<int, CopyCounter, AVLBalance> right(left.get_allocator());
+  for (int i = 0; i < 100; i += 3) right.insert(i, CopyCounter(-i));
+
+  CopyCounter::copies = 0;
+  left.union_with(std::move(right));
+  EXPECT_EQ(CopyCounter::copies, 0);
+  EXPECT_TRUE(right.empty());
+  EXPECT_EQ(left.size(), 67);
+  EXPECT_EQ(left.at(6).id, 6);  // this map's entry wins
+  EXPECT_EQ(left.at(9).id, -9);
+
+  left.intersect_with(left);
+  EXPECT_EQ(left.size(), 67);
+  left.difference_with(left);
+  EXPECT_TRUE(left.empty());
+}
+
+// CopyCounter is not trivially copyable, so saving it needs a codec.
+} // namespace
+
+template <>
+struct MapCodec<CopyCounter> {
+  static void encode(string& out, const CopyCounter& value) { MapCodec<int>::encode(out, value.id); }
+  static CopyCounter decode(const char*& p, const char* end) { return CopyCounter(MapCodec<int>::decode(p, end)); }
+};
+
+namespace {
+
+string tempMapFile(const string& name) {
+  return TempDir() + "bstmap_" + name + ".bin";
+}
+
+TEST(BSTMapFile, TriviallyCopyableEntriesRoundTripAsArrays) {
+  string path = tempMapFile("raw");
+  BSTMap<int, double, AVLBalance> map;
+  Random::seed(17);
+  for (int i = 0; i < 10000; i++) map.insert(Random::randInt(1000000), i / 4.0);
+  map.save(path);
+  // Header, keys padded to a cache line, then values.
+  EXPECT_EQ(filesystem::file_size(path), 64 + (map.size() * sizeof(int) + 63) / 64 * 64 + map.size() * sizeof(double));
+
+  BSTMap<int, double, AVLBalance> loaded;
+  loaded.insert(-1, 0);
+  loaded.load(path);
+  EXPECT_EQ(loaded, map);
+  EXPECT_LE(loaded.height(), 15);
+
+  BSTMap<int, double, AVLBalance>().save(path);
+  loaded.load(path);
+  EXPECT_TRUE(loaded.empty());
+  filesystem::remove(path);
+}
+
+TEST(BSTMapFile, OtherTypesGoThroughCodecs) {
+  string path = tempMapFile("codec");
+  BSTMap<string, string> words;
+  words.insert("", "empty key");
+  words.insert("alpha", "");
+  words.insert(string("nul\0byte", 8), string(1000, 'x'));
+  words.save(path);
+  BSTMap<string, string> loadedWords;
+  loadedWords.load(path);
+  EXPECT_EQ(loadedWords, words);
+
+  BSTMap<int, CopyCounter> counters;
+  for (int i = 0; i < 100; i++) counters.insert(i, CopyCounter(-i));
+  counters.save(path);
+  BSTMap<int, CopyCounter> loadedCounters;
+  loadedCounters.load(path);
+  ASSERT_EQ(loadedCounters.size(), 100);
+  for (int i = 0; i < 100; i++) EXPECT_EQ(loadedCounters.at(i).id, -i);
+  filesystem::remove(path);
+}
+
+TEST(BSTMapFile, RejectsFilesItCannotRead) {
+  string path = tempMapFile("bad");
+  BSTMap<int, int> map;
+  EXPECT_THROW(map.load(tempMapFile("missing")), runtime_error);
+
+  for (int i = 0; i < 100; i++) map.insert(i, i);
+  map.save(path);
+  BSTMap<int, string> otherTypes;
+  otherTypes.insert(1, "kept?");
+  EXPECT_THROW(otherTypes.load(path), runtime_error);
+  EXPECT_TRUE(otherTypes.empty());
+
+  filesystem::resize_file(path, filesystem::file_size(path) - 1);
+  EXPECT_THROW(map.load(path), runtime_error);
+  EXPECT_TRUE(map.empty());
+
+  BSTMap<string, int> words;
+  words.insert("a", 1);
+  words.insert("b", 2);
+  words.save(path);
+  filesystem::resize_file(path, filesystem::file_size(path) - 1);
+  EXPECT_THROW(words.load(path), runtime_error);
+
+  {
+    ofstream file(path, ios::binary | ios::trunc);
+    file << "not a map file, but long enough to hold the header it is missing...";
+  }
+  EXPECT_THROW(map.load(path), runtime_error);
+
+  // Keys out of order are caught while the chain is built.
+  BSTMap<int, int> pair;
+  pair.insert(1, 10);
+  pair.insert(2, 20);
+  pair.save(path);
+  {
+    fstream file(path, ios::binary | ios::in | ios::out);
+    int swapped[2] = {2, 1};
+    file.seekp(64);
+    file.write(reinterpret_cast<const char*>(swapped), sizeof(swapped));
+  }
+  EXPECT_THROW(pair.load(path), invalid_argument);
+  EXPECT_TRUE(pair.empty());
+  filesystem::remove(path);
+}
+
+// What to_string() printed before it streamed: operator<< and endl per entry.
+template <typename Map>
+string streamedEntries(const Map& map) {
+  ostringstream ss;
+  for (auto [key, value] : map) ss << key << ": " << value << endl;
+  return ss.str();
+}
+
+TEST(BSTMapText, MatchesOperatorOutputForEveryType) {
+  BSTMap<double, float> numbers;
+  for (double key : {-0.0, 1.0 / 3, 1e20, 123456789.0, 1e-7, numeric_limits<double>::infinity(),
+                     -numeric_limits<double>::max()}) {
+    numbers.insert(key, static_cast<float>(key * 7));
+  }
+  EXPECT_EQ(numbers.to_string(), streamedEntries(numbers));
+
+  BSTMap<long long, unsigned long long> integers;
+  integers.insert(numeric_limits<long long>::min(), numeric_limits<unsigned long long>::max());
+  integers.insert(0, 0);
+  integers.insert(-42, 42);
+  EXPECT_EQ(integers.to_string(), streamedEntries(integers));
+
+  BSTMap<char, bool> characters;
+  characters.insert('a', true);
+  characters.insert('z', false);
+  EXPECT_EQ(characters.to_string(), "a: 1\nz: 0\n");
+
+  BSTMap<string, string> words;
+  words.insert("key", "value with spaces");
+  words.insert("", "");
+  EXPECT_EQ(words.to_string(), ": \nkey: value with spaces\n");
+}
+
+TEST(BSTMapText, WriteToHonoursStreamFormatting) {
+  BSTMap<int, double> map;
+  for (int i = 0; i < 20000; i++) map.insert(i * 7, i / 8.0);
+  ostringstream plain;
+  plain << map;
+  EXPECT_EQ(plain.str(), map.to_string());
+  EXPECT_EQ(plain.str(), streamedEntries(map));
+
+  ostringstream formatted;
+  formatted << hex << setprecision(2);
+  map.write_to(formatted);
+  ostringstream expected;
+  expected << hex << setprecision(2);
+  for (auto [key, value] : map) expected << key << ": " << value << '\n';
+  EXPECT_EQ(formatted.str(), expected.str());
+}
+
+using CountingMap = BSTMap<int, int, AVLBalance, NodePool<pair<const int, int>>, SynthThreeWay, CountStats>;
+
+TEST(BSTMapStats, CountingPolicyTalliesEachOperation) {
+  CountingMap map;
+  for (int i = 1; i <= 7; i++) map.insert(i, i);
+  BSTMapStats stats = map.stats();
+  EXPECT_EQ(stats.inserts, 7);
+  EXPECT_EQ(stats.comparisons, stats.insert_visits);  // one per level, none to link the node
+  EXPECT_EQ(stats.allocations, 7);
+  EXPECT_EQ(stats.frees, 0);
+  EXPECT_THAT(stats.depth_histogram, ElementsAre(1, 2, 4));
+  EXPECT_EQ(stats.height, 3);
+  EXPECT_DOUBLE_EQ(stats.average_path_length, 17.0 / 7);
+
+  map.reset_stats();
+  EXPECT_TRUE(map.contains(4));  // the root
+  stats = map.stats();
+  EXPECT_EQ(stats.lookups, 1);
+  EXPECT_EQ(stats.lookup_visits, 1);
+  EXPECT_EQ(stats.comparisons, 1);
+  EXPECT_TRUE(map.contains(1));
+  EXPECT_EQ(map.stats().lookup_visits, 4);
+
+  map.erase(7);
+  stats = map.stats();
+  EXPECT_EQ(stats.erases, 1);
+  EXPECT_EQ(stats.erase_visits, 3);
+  EXPECT_EQ(stats.frees, 1);
+  EXPECT_EQ(stats.lookups, 2);
+
+  map.insert(4, 0);  // already present
+  stats = map.stats();
+  EXPECT_EQ(stats.inserts, 1);
+  EXPECT_EQ(stats.insert_visits, 1);
+  EXPECT_EQ(stats.allocations, 0);
+
+  map.clear();
+  stats = map.stats();
+  EXPECT_EQ(stats.frees, 7);
+  EXPECT_EQ(stats.height, 0);
+  EXPECT_TRUE(stats.depth_histogram.empty());
+  EXPECT_EQ(stats.average_path_length, 0);
+}
+
+TEST(BSTMapStats, DefaultPolicyReportsOnlyShape) {
+  BSTMap<int, int> map;
+  for (int i = 0; i < 5; i++) map.insert(i, i);
+  EXPECT_TRUE(map.contains(4));
+  BSTMapStats stats = map.stats();
+  EXPECT_EQ(stats.comparisons, 0);
+  EXPECT_EQ(stats.lookups, 0);
+  EXPECT_EQ(stats.allocations, 0);
+  EXPECT_EQ(stats.size, 5);
+  EXPECT_EQ(stats.height, map.height());
+  EXPECT_THAT(stats.depth_histogram, ElementsAre(1, 1, 1, 1, 1));  // sorted input degenerates
+  EXPECT_DOUBLE_EQ(stats.average_path_length, 3);
+}
+
+// Large enough that the set operations would fork on a plain map; the
+// counts must come out the same every run (and TSan must stay quiet).
+TEST(BSTMapStats, SetOperationsCountExactly) {
+  Random::seed(20);
+  vector<int> keys(200000);
+  vector<int> others(200000);
+  for (int& key : keys) key = Random::randInt(1000000);
+  for (int& key : others) key = Random::randInt(1000000);
+  auto run = [&](int op) {
+    CountingMap map;
+    CountingMap other(map.get_allocator());
+    for (int key : keys) map.insert(key, key);
+    for (int key : others) other.insert(key, -key);
+    map.reset_stats();
+    if (op == 0) map.intersect_with(other);
+    if (op == 1) map.union_with(std::move(other));
+    if (op == 2) map.difference_with(other);
+    return map.stats().comparisons;
+  };
+  for (int op = 0; op < 3; op++) {
+    size_t comparisons = run(op);
+    EXPECT_GT(comparisons, 0) << op;
+    EXPECT_EQ(run(op), comparisons) << op;
+  }
+}
+
+template <typename Balance>
+class BSTMapEnds : public Test {};
+TYPED_TEST_SUITE(BSTMapEnds, BalancePolicies);
+
+TYPED_TEST(BSTMapEnds, PeekAndRemoveAtBothEnds) {
+  BSTMap<int, int, TypeParam> map;
+  EXPECT_THROW(map.peek_min(), runtime_error);
+  EXPECT_THROW(map.remove_max(), runtime_error);
+  std::map<int, int> expected;
+  Random::seed(21);
+  for (int i = 0; i < 500; i++) {
+    int key = Random::randInt(10000);
+    map.insert(key, i);
+    expected.insert({key, i});
+    ASSERT_EQ(map.peek_min().first, expected.begin()->first);
+    ASSERT_EQ(map.peek_max().first, expected.rbegin()->first);
+  }
+  map.peek_max().second = -1;
+  EXPECT_EQ(prev(map.end())->second, -1);
+  const auto& view = map;
+  static_assert(is_same_v<decltype(view.peek_min()), pair<const int&, const int&>>);
+  static_assert(is_same_v<decltype(view.peek_max()), pair<const int&, const int&>>);
+  EXPECT_EQ(view.peek_max().second, -1);
+  expected.rbegin()->second = -1;
+
+  while (expected.size() > 100) {
+    auto largest = map.remove_max();
+    EXPECT_EQ(largest.first, expected.rbegin()->first);
+    EXPECT_EQ(largest.second, expected.rbegin()->second);
+    expected.erase(prev(expected.end()));
+    auto smallest = map.remove_min();
+    EXPECT_EQ(smallest.first, expected.begin()->first);
+    expected.erase(expected.begin());
+    ASSERT_EQ(map.peek_min().first, expected.begin()->first);
+    ASSERT_EQ(map.peek_max().first, expected.rbegin()->first);
+  }
+
+  // Operations that rebuild the tree refresh the cached ends too.
+  BSTMap<int, int, TypeParam> upper = map.split(5000);
+  EXPECT_LT(map.peek_max().first, 5000);
+  EXPECT_GE(upper.peek_min().first, 5000);
+  map.erase_range(0, map.peek_min().first + 1);
+  EXPECT_EQ(map.begin()->first, map.peek_min().first);
+  vector<pair<int, int>> sorted = {{1, 1}, {2, 2}, {3, 3}};
+  map.assign_sorted(sorted.begin(), sorted.end());
+  EXPECT_EQ(map.peek_min().first, 1);
+  EXPECT_EQ(map.peek_max().first, 3);
+  BSTMap<int, int, TypeParam> copy(map);
+  copy.clear();
+  EXPECT_THROW(copy.peek_max(), runtime_error);
+  EXPECT_EQ(map.peek_max().first, 3);
+}
+
+// Fails on the nth assignment through it.
+struct ThrowingOutput {
+  vector<pair<string, int>>* sink;
+  int failAt;
+
+  ThrowingOutput& operator*() { return *this; }
+  ThrowingOutput& operator++() { return *this; }
+  ThrowingOutput& operator=(pair<string, int> entry) {
+    if (static_cast<int>(sink->size()) == failAt) throw runtime_error("output full");
+    sink->push_back(std::move(entry));
+    return *this;
+  }
+};
+
+TYPED_TEST(BSTMapEnds, PopMinBatchDrainsInKeyOrder) {
+  BSTMap<string, int, TypeParam> map;
+  std::map<string, int> expected;
+  for (int i = 0; i < 1000; i++) {
+    string key = "key" + std::to_string(i * 7919 % 1000);
+    map.insert(key, i);
+    expected.insert({key, i});
+  }
+  vector<pair<string, int>> out;
+  EXPECT_EQ(map.pop_min_batch(0, back_inserter(out)), 0);
+  for (size_t k : {1, 10, 255, 300}) {
+    out.clear();
+    EXPECT_EQ(map.pop_min_batch(k, back_inserter(out)), k);
+    vector<pair<string, int>> first(expected.begin(), next(expected.begin(), k));
+    EXPECT_EQ(out, first);
+    expected.erase(expected.begin(), next(expected.begin(), k));
+    EXPECT_EQ(map.size(), expected.size());
+    EXPECT_EQ(map.peek_min().first, expected.begin()->first);
+    EXPECT_EQ(map.at(expected.rbegin()->first), expected.rbegin()->second);
+  }
+
+  // A failed write loses the entries written and the one being written.
+  out.clear();
+  EXPECT_THROW(map.pop_min_batch(50, ThrowingOutput{&out, 5}), runtime_error);
+  EXPECT_EQ(out.size(), 5);
+  expected.erase(expected.begin(), next(expected.begin(), 6));
+  using Entries = vector<pair<string, int>>;
+  EXPECT_EQ(Entries(map.begin(), map.end()), Entries(expected.begin(), expected.end()));
+
+  out.clear();
+  EXPECT_EQ(map.pop_min_batch(10000, back_inserter(out)), expected.size());
+  EXPECT_TRUE(map.empty());
+  EXPECT_THROW(map.peek_min(), runtime_error);
+}
+
+template <typename Balance>
+class BSTMapNodeHandle : public Test {};
+TYPED_TEST_SUITE(BSTMapNodeHandle, BalancePolicies);
+
+TYPED_TEST(BSTMapNodeHandle, EraseRelinksTheSuccessor) {
+  BSTMap<int, CopyCounter, TypeParam> map;
+  for (int key : {8, 4, 12, 2, 6, 10, 14, 9}) map.insert(key, CopyCounter(key));
+  CopyCounter* nine = &map.at(9);  // successor of 8, deep in its right subtree
+  CopyCounter* six = &map.at(6);   // successor of 4, its right child
+
+  CopyCounter::copies = 0;
+  map.erase(8);
+  map.erase(4);
+  EXPECT_EQ(CopyCounter::copies, 0);
+  EXPECT_EQ(&map.at(9), nine);
+  EXPECT_EQ(&map.at(6), six);
+  EXPECT_EQ(nine->id, 9);
+  EXPECT_EQ(six->id, 6);
+
+  vector<int> keys;
+  for (auto [key, value] : map) keys.push_back(key);
+  EXPECT_THAT(keys, ElementsAre(2, 6, 9, 10, 12, 14));
+  EXPECT_EQ(map.erase(map.find(10))->first, 12);
+}
+
+TYPED_TEST(BSTMapNodeHandle, ExtractedNodesMoveBetweenMaps) {
+  using Map = BSTMap<int, CopyCounter, TypeParam>;
+  Map source;
+  for (int i = 0; i < 50; i++) source.insert(i, CopyCounter(i));
+  Map target(source.get_allocator());
+  target.insert(7, CopyCounter(-7));
+
+  CopyCounter::copies = 0;
+  CopyCounter::constructions = 0;
+  CopyCounter* address = &source.at(20);
+  typename Map::node_type handle = source.extract(20);
+  ASSERT_FALSE(handle.empty());
+  EXPECT_EQ(handle.key(), 20);
+  EXPECT_EQ(&handle.mapped(), address);
+  EXPECT_FALSE(source.contains(20));
+  EXPECT_EQ(source.size(), 49);
+
+  auto result = target.insert(std::move(handle));
+  EXPECT_TRUE(result.inserted);
+  EXPECT_TRUE(result.node.empty());
+  EXPECT_EQ(result.position->first, 20);
+  EXPECT_EQ(&target.at(20), address);
+
+  // A key that is already present leaves the entry in the returned handle.
+  auto duplicate = target.insert(source.extract(7));
+  EXPECT_FALSE(duplicate.inserted);
+  EXPECT_EQ(duplicate.position->second.id, -7);
+  ASSERT_TRUE(duplicate.node);
+  EXPECT_EQ(duplicate.node.mapped().id, 7);
+  EXPECT_EQ(CopyCounter::copies + CopyCounter::constructions, 0);
+
+  EXPECT_TRUE(source.extract(1000).empty());
+  EXPECT_FALSE(target.insert(typename Map::node_type()).inserted);
+
+  // Maps with separate pools move the entry into a new node instead.
+  Map separate;
+  separate.insert(source.extract(source.begin()));
+  EXPECT_EQ(separate.at(0).id, 0);
+  EXPECT_EQ(CopyCounter::copies, 0);
+}
+
+TEST(BSTMapNodeHandle, HandleOutlivesItsMap) {
+  BSTMap<int, string>::node_type handle;
+  {
+    BSTMap<int, string> map;
+    map.insert(1, string(100, 'x'));
+    map.insert(2, "two");
+    handle = map.extract(1);
+  }
+  EXPECT_EQ(handle.key(), 1);
+  EXPECT_EQ(handle.mapped(), string(100, 'x'));
+  BSTMap<int, string> other;
+  other.insert(std::move(handle));
+  EXPECT_EQ(other.at(1), string(100, 'x'));
+}
+
+using SplayMap = BSTMap<int, int, SplayBalance, NodePool<pair<const int, int>>, SynthThreeWay, CountStats>;
+
+TEST(BSTMapSplay, RepeatedHitsMoveTowardTheRoot) {
+  SplayMap map;
+  Random::seed(23);
+  for (int i = 0; i < 1000; i++) map.insert(Random::randInt(100000), i);
+  map.reset_stats();
+
+  const SplayMap& view = map;
+  int hot = view.kth(500);
+  EXPECT_TRUE(view.contains(hot));
+  size_t firstVisits = map.stats().lookup_visits;
+  for (int i = 0; i < 10; i++) EXPECT_EQ(view.at(hot), map.find(hot)->second);
+  map.reset_stats();
+  EXPECT_NE(view.find(hot), view.end());
+  EXPECT_LE(map.stats().lookup_visits, 2);
+  EXPECT_GT(firstVisits, 2);
+
+  EXPECT_FALSE(view.contains(-1));  // a miss leaves the tree as it was
+  map.reset_stats();
+  EXPECT_TRUE(view.contains(hot));
+  EXPECT_LE(map.stats().lookup_visits, 2);
+}
+
+TEST(BSTMapSplay, LookupsKeepOrderAndCounts) {
+  SplayMap map;
+  std::map<int, int> expected;
+  Random::seed(29);
+  for (int i = 0; i < 2000; i++) {
+    int key = Random::randInt(5000);
+    map.insert(key, i);
+    expected.insert({key, i});
+    if (i % 3 == 0) map.contains(Random::randInt(5000));
+    if (i % 7 == 0 && map.contains(key)) map.erase(key), expected.erase(key);
+  }
+  ASSERT_EQ(map.size(), expected.size());
+  size_t i = 0;
+  for (auto [key, value] : expected) {
+    EXPECT_EQ(map.at(key), value);
+    EXPECT_EQ(map.rank(key), i);
+    EXPECT_EQ(map.kth(i++), key);
+  }
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(), expected.end(),
+                         [](const auto& a, const auto& b) { return a.first == b.first && a.second == b.second; }));
+  BSTMapStats stats = map.stats();
+  EXPECT_EQ(accumulate(stats.depth_histogram.begin(), stats.depth_histogram.end(), size_t(0)), map.size());
+}
+
+template <typename Balance>
+class BSTMapFinger : public Test {};
+TYPED_TEST_SUITE(BSTMapFinger, BalancePolicies);
+
+TYPED_TEST(BSTMapFinger, HintedInsertMatchesPlainInsert) {
+  using Map = BSTMap<int, int, TypeParam>;
+  Map map;
+  std::map<int, int> expected;
+  Random::seed(37);
+  typename Map::iterator last = map.end();
+  for (int i = 0; i < 3000; i++) {
+    int key = i * 4 + Random::randInt(40);  // nearly sorted, with repeats
+    typename Map::const_iterator hint = last;
+    if (i % 7 == 0) hint = map.begin();
+    if (i % 11 == 0) hint = map.end();
+    last = map.insert(hint, key, i);
+    auto [pos, added] = expected.insert({key, i});
+    EXPECT_EQ(last->first, key);
+    EXPECT_EQ(last->second, pos->second);  // an existing entry is kept
+  }
+  ASSERT_EQ(map.size(), expected.size());
+  EXPECT_TRUE(std::equal(map.begin(), map.end(), expected.begin(), expected.end(),
+                         [](const auto& a, const auto& b) { return a.first == b.first && a.second == b.second; }));
+  EXPECT_EQ(map.begin()->first, expected.begin()->first);
+  EXPECT_EQ((--map.end())->first, expected.rbegin()->first);
+
+  Map empty;
+  EXPECT_EQ(empty.insert(empty.end(), 5, 50)->second, 50);
+  EXPECT_EQ(empty.insert(empty.begin(), 1, 10)->first, 1);
+}
+
+TYPED_TEST(BSTMapFinger, FindNearAgreesWithFind) {
+  using Map = BSTMap<int, int, TypeParam>;
+  Map map;
+  Random::seed(41);
+  for (int i = 0; i < 2000; i++) map.insert(Random::randInt(10000), i);
+  vector<int> keys;
+  for (auto [key, value] : map) keys.push_back(key);
+
+  for (int i = 0; i < 2000; i++) {
+    int key = Random::randInt(10000);
+    auto near = map.find(keys[Random::randInt(keys.size())]);
+    auto expected = map.find(key);
+    EXPECT_EQ(map.find_near(near, key), expected);
+    EXPECT_EQ(map.find_near(map.end(), key), map.find(key));
+  }
+  const Map& view = map;
+  EXPECT_EQ(view.find_near(view.begin(), keys.back())->first, keys.back());
+  Map none;
+  EXPECT_EQ(none.find_near(none.end(), 1), none.end());
+}
+
+TEST(BSTMapFinger, HintsMakeSortedInsertsCheap) {
+  CountingMap hinted;
+  CountingMap plain;
+  auto hint = hinted.end();
+  for (int i = 0; i < 1 << 16; i++) {
+    hint = hinted.insert(hint, i, i);
+    plain.insert(i, i);
+  }
+  EXPECT_TRUE(hinted == plain);
+  // Appending from the largest entry visits only that entry; from the root
+  // every insert pays the full height of 16 or more.
+  EXPECT_LT(hinted.stats().insert_visits, 2 * hinted.size());
+  EXPECT_GT(plain.stats().insert_visits, 15 * plain.size());
+  EXPECT_EQ(hinted.stats().comparisons, hinted.stats().insert_visits);
+  EXPECT_EQ(plain.stats().comparisons, plain.stats().insert_visits);
+
+  auto near = hinted.find(30000);
+  hinted.reset_stats();
+  for (int key = 30001; key < 30100; key++) {
+    near = hinted.find_near(near, key);
+    ASSERT_EQ(near->first, key);
+  }
+  EXPECT_LT(hinted.stats().lookup_visits, 4 * 99);
+}
 } // namespace
@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+// B+ tree with the BSTMap interface. Entries live in wide leaves of about
+// NodeBytes, keys packed together ahead of the values, so a lookup touches a
+// few cache lines per level instead of one node per comparison. Leaves are
+// chained for in-order iteration. Keys and values must be default
+// constructible, since node arrays are allocated up front.
+template <typename KeyT, typename ValT, size_t NodeBytes = 256>
+class BTreeMap {
+ private:
+  static constexpr size_t LeafCap = max<size_t>(3, NodeBytes / (sizeof(KeyT) + sizeof(ValT)));
+  static constexpr size_t InnerCap = max<size_t>(3, NodeBytes / (sizeof(KeyT) + sizeof(void*)));
+
+  struct Node {
+    bool leaf;
+    unsigned count;  // Keys held
+
+    explicit Node(bool leaf) : leaf(leaf), count(0) {}
+  };
+
+  struct Leaf : Node {
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+    KeyT keys[LeafCap];
+    ValT vals[LeafCap];
+
+    Leaf() : Node(true) {}
+  };
+
+  // keys[i] separates children[i] (keys < keys[i]) from children[i + 1].
+  struct Inner : Node {
+    KeyT keys[InnerCap];
+    Node* children[InnerCap + 1];
+
+    Inner() : Node(false) {}
+  };
+
+  Node* root;
+  size_t sz;
+  Leaf* curr;
+  unsigned currIdx;
+
+  static Leaf* asLeaf(Node* node) { return static_cast<Leaf*>(node); }
+  static Inner* asInner(Node* node) { return static_cast<Inner*>(node); }
+
+  static bool isFull(Node* node) { return node->count == (node->leaf ? LeafCap : InnerCap); }
+
+  // A non-root node never drops below this many keys.
+  static unsigned minCount(Node* node) { return ((node->leaf ? LeafCap : InnerCap) - 1) / 2; }
+
+  // Arithmetic keys are counted with a branch-free scan that the compiler
+  // vectorises; a node is only a few cache lines, so that beats a binary
+  // search full of mispredicted branches.
+  static unsigned childIndex(const Inner* inner, const KeyT& key) {
+    if constexpr (is_arithmetic_v<KeyT>) {
+      unsigned n = 0;
+      for (unsigned i = 0; i < inner->count; i++) n += !(key < inner->keys[i]);
+      return n;
+    } else {
+      return upper_bound(inner->keys, inner->keys + inner->count, key) - inner->keys;
+    }
+  }
+
+  static unsigned leafIndex(const Leaf* leaf, const KeyT& key) {
+    if constexpr (is_arithmetic_v<KeyT>) {
+      unsigned n = 0;
+      for (unsigned i = 0; i < leaf->count; i++) n += leaf->keys[i] < key;
+      return n;
+    } else {
+      return lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys;
+    }
+  }
+
+  Leaf* findLeaf(const KeyT& key) const {
+    Node* node = root;
+    while (node && !node->leaf) node = asInner(node)->children[childIndex(asInner(node), key)];
+    return asLeaf(node);
+  }
+
+  // Leaf and slot holding key, or a null leaf.
+  pair<Leaf*, unsigned> findEntry(const KeyT& key) const {
+    Leaf* leaf = findLeaf(key);
+    if (!leaf) return {nullptr, 0};
+    unsigned i = leafIndex(leaf, key);
+    if (i == leaf->count || key < leaf->keys[i]) return {nullptr, 0};
+    return {leaf, i};
+  }
+
+  Leaf* firstLeaf() const {
+    Node* node = root;
+    while (node && !node->leaf) node = asInner(node)->children[0];
+    return asLeaf(node);
+  }
+
+  Leaf* lastLeaf() const {
+    Node* node = root;
+    while (node && !node->leaf) node = asInner(node)->children[node->count];
+    return asLeaf(node);
+  }
+
+  static void deleteSubtree(Node* node) {
+    if (!node) return;
+    if (node->leaf) {
+      delete asLeaf(node);
+      return;
+    }
+    Inner* inner = asInner(node);
+    for (unsigned i = 0; i <= inner->count; i++) deleteSubtree(inner->children[i]);
+    delete inner;
+  }
+
+  // Clones a subtree, chaining the new leaves after lastLeaf.
+  static Node* cloneSubtree(const Node* node, Leaf*& lastLeaf) {
+    if (node->leaf) {
+      const Leaf* src = static_cast<const Leaf*>(node);
+      Leaf* copy = new Leaf;
+      try {
+        std::copy(src->keys, src->keys + src->count, copy->keys);
+        std::copy(src->vals, src->vals + src->count, copy->vals);
+      } catch (...) {
+        delete copy;
+        throw;
+      }
+      copy->count = src->count;
+      copy->prev = lastLeaf;
+      if (lastLeaf) lastLeaf->next = copy;
+      lastLeaf = copy;
+      return copy;
+    }
+    const Inner* src = static_cast<const Inner*>(node);
+    Inner* copy = new Inner;
+    copy->children[0] = nullptr;
+    try {
+      // count trails the cloned children so a partial copy can be deleted.
+      for (unsigned i = 0; i <= src->count; i++) {
+        copy->children[i] = cloneSubtree(src->children[i], lastLeaf);
+        copy->count = i;
+        if (i < src->count) copy->keys[i] = src->keys[i];
+      }
+    } catch (...) {
+      deleteSubtree(copy);
+      throw;
+    }
+    return copy;
+  }
+
+  // Splits the full child parent->children[i] in two and hangs the right
+  // half after it.
+  static void splitChild(Inner* parent, unsigned i) {
+    Node* child = parent->children[i];
+    Node* right;
+    KeyT separator;
+    if (child->leaf) {
+      Leaf* left = asLeaf(child);
+      Leaf* split = new Leaf;
+      unsigned mid = left->count / 2;
+      move(left->keys + mid, left->keys + left->count, split->keys);
+      move(left->vals + mid, left->vals + left->count, split->vals);
+      split->count = left->count - mid;
+      left->count = mid;
+      split->next = left->next;
+      if (split->next) split->next->prev = split;
+      split->prev = left;
+      left->next = split;
+      separator = split->keys[0];
+      right = split;
+    } else {
+      Inner* left = asInner(child);
+      Inner* split = new Inner;
+      unsigned mid = left->count / 2;
+      separator = std::move(left->keys[mid]);
+      move(left->keys + mid + 1, left->keys + left->count, split->keys);
+      move(left->children + mid + 1, left->children + left->count + 1, split->children);
+      split->count = left->count - mid - 1;
+      left->count = mid;
+      right = split;
+    }
+    move_backward(parent->keys + i, parent->keys + parent->count, parent->keys + parent->count + 1);
+    move_backward(parent->children + i + 1, parent->children + parent->count + 1,
+                  parent->children + parent->count + 2);
+    parent->keys[i] = std::move(separator);
+    parent->children[i + 1] = right;
+    parent->count++;
+  }
+
+  static void borrowFromLeft(Inner* parent, unsigned i) {
+    Node* child = parent->children[i];
+    Node* sibling = parent->children[i - 1];
+    if (child->leaf) {
+      Leaf* to = asLeaf(child);
+      Leaf* from = asLeaf(sibling);
+      move_backward(to->keys, to->keys + to->count, to->keys + to->count + 1);
+      move_backward(to->vals, to->vals + to->count, to->vals + to->count + 1);
+      to->keys[0] = std::move(from->keys[from->count - 1]);
+      to->vals[0] = std::move(from->vals[from->count - 1]);
+      parent->keys[i - 1] = to->keys[0];
+    } else {
+      Inner* to = asInner(child);
+      Inner* from = asInner(sibling);
+      move_backward(to->keys, to->keys + to->count, to->keys + to->count + 1);
+      move_backward(to->children, to->children + to->count + 1, to->children + to->count + 2);
+      to->keys[0] = std::move(parent->keys[i - 1]);
+      to->children[0] = from->children[from->count];
+      parent->keys[i - 1] = std::move(from->keys[from->count - 1]);
+    }
+    sibling->count--;
+    child->count++;
+  }
+
+  static void borrowFromRight(Inner* parent, unsigned i) {
+    Node* child = parent->children[i];
+    Node* sibling = parent->children[i + 1];
+    if (child->leaf) {
+      Leaf* to = asLeaf(child);
+      Leaf* from = asLeaf(sibling);
+      to->keys[to->count] = std::move(from->keys[0]);
+      to->vals[to->count] = std::move(from->vals[0]);
+      move(from->keys + 1, from->keys + from->count, from->keys);
+      move(from->vals + 1, from->vals + from->count, from->vals);
+      parent->keys[i] = from->keys[0];
+    } else {
+      Inner* to = asInner(child);
+      Inner* from = asInner(sibling);
+      to->keys[to->count] = std::move(parent->keys[i]);
+      to->children[to->count + 1] = from->children[0];
+      parent->keys[i] = std::move(from->keys[0]);
+      move(from->keys + 1, from->keys + from->count, from->keys);
+      move(from->children + 1, from->children + from->count + 1, from->children);
+    }
+    sibling->count--;
+    child->count++;
+  }
+
+  // Folds parent->children[i + 1] and the separator between them into
+  // parent->children[i].
+  static void mergeChildren(Inner* parent, unsigned i) {
+    Node* left = parent->children[i];
+    Node* right = parent->children[i + 1];
+    if (left->leaf) {
+      Leaf* to = asLeaf(left);
+      Leaf* from = asLeaf(right);
+      move(from->keys, from->keys + from->count, to->keys + to->count);
+      move(from->vals, from->vals + from->count, to->vals + to->count);
+      to->count += from->count;
+      to->next = from->next;
+      if (to->next) to->next->prev = to;
+      delete from;
+    } else {
+      Inner* to = asInner(left);
+      Inner* from = asInner(right);
+      to->keys[to->count] = std::move(parent->keys[i]);
+      move(from->keys, from->keys + from->count, to->keys + to->count + 1);
+      move(from->children, from->children + from->count + 1, to->children + to->count + 1);
+      to->count += from->count + 1;
+      delete from;
+    }
+    move(parent->keys + i + 1, parent->keys + parent->count, parent->keys + i);
+    move(parent->children + i + 2, parent->children + parent->count + 1, parent->children + i + 1);
+    parent->count--;
+  }
+
+  // Makes sure parent->children[i] can lose a key before descending into
+  // it. Returns the index of the child that now covers the same keys.
+  static unsigned refillChild(Inner* parent, unsigned i) {
+    if (i > 0 && parent->children[i - 1]->count > minCount(parent->children[i - 1])) {
+      borrowFromLeft(parent, i);
+      return i;
+    }
+    if (i < parent->count && parent->children[i + 1]->count > minCount(parent->children[i + 1])) {
+      borrowFromRight(parent, i);
+      return i;
+    }
+    if (i < parent->count) {
+      mergeChildren(parent, i);
+      return i;
+    }
+    mergeChildren(parent, i - 1);
+    return i - 1;
+  }
+
+  template <typename K, typename V>
+  void insertEntry(K&& key, V&& value) {
+    if (!root) root = new Leaf;
+    if (isFull(root)) {
+      Inner* top = new Inner;
+      top->children[0] = root;
+      splitChild(top, 0);
+      root = top;
+    }
+    Node* node = root;
+    while (!node->leaf) {
+      Inner* inner = asInner(node);
+      unsigned i = childIndex(inner, key);
+      if (isFull(inner->children[i])) {
+        splitChild(inner, i);
+        if (!(key < inner->keys[i])) i++;
+      }
+      node = inner->children[i];
+    }
+    Leaf* leaf = asLeaf(node);
+    unsigned i = leafIndex(leaf, key);
+    if (i < leaf->count && !(key < leaf->keys[i])) return;
+    move_backward(leaf->keys + i, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+    move_backward(leaf->vals + i, leaf->vals + leaf->count, leaf->vals + leaf->count + 1);
+    leaf->keys[i] = std::forward<K>(key);
+    leaf->vals[i] = std::forward<V>(value);
+    leaf->count++;
+    sz++;
+  }
+
+  // Removes key on a single top-down pass, refilling every child before
+  // stepping into it so no fix-up has to travel back up.
+  pair<KeyT, ValT> eraseEntry(const KeyT& key) {
+    if (!root) throw out_of_range("Key not found");
+    Node* node = root;
+    while (!node->leaf) {
+      Inner* inner = asInner(node);
+      unsigned i = childIndex(inner, key);
+      if (inner->children[i]->count <= minCount(inner->children[i])) i = refillChild(inner, i);
+      node = inner->children[i];
+    }
+    shrinkRoot();
+
+    Leaf* leaf = asLeaf(node);
+    unsigned i = leafIndex(leaf, key);
+    if (i == leaf->count || key < leaf->keys[i]) throw out_of_range("Key not found");
+
+    pair<KeyT, ValT> result = {std::move(leaf->keys[i]), std::move(leaf->vals[i])};
+    move(leaf->keys + i + 1, leaf->keys + leaf->count, leaf->keys + i);
+    move(leaf->vals + i + 1, leaf->vals + leaf->count, leaf->vals + i);
+    leaf->count--;
+    sz--;
+    if (sz == 0) {
+      delete leaf;
+      root = nullptr;
+    }
+    return result;
+  }
+
+  // Drops inner roots left without keys by a merge.
+  void shrinkRoot() {
+    while (!root->leaf && root->count == 0) {
+      Inner* old = asInner(root);
+      root = old->children[0];
+      delete old;
+    }
+  }
+
+ public:
+  // Bidirectional in-order iterator over the leaf chain; dereferencing
+  // yields a pair of references, as with BSTMap.
+  template <bool Const>
+  class Iterator {
+    friend class BTreeMap;
+
+    Leaf* leaf;
+    unsigned idx;
+    const BTreeMap* tree;
+
+    Iterator(Leaf* leaf, unsigned idx, const BTreeMap* tree) : leaf(leaf), idx(idx), tree(tree) {}
+
+   public:
+    using iterator_category = bidirectional_iterator_tag;
+    using value_type = pair<const KeyT, ValT>;
+    using difference_type = ptrdiff_t;
+    using reference = pair<const KeyT&, conditional_t<Const, const ValT&, ValT&>>;
+
+    struct pointer {
+      reference ref;
+      const reference* operator->() const { return &ref; }
+    };
+
+    Iterator() : leaf(nullptr), idx(0), tree(nullptr) {}
+
+    template <bool WasConst>
+      requires(Const && !WasConst)
+    Iterator(const Iterator<WasConst>& other) : leaf(other.leaf), idx(other.idx), tree(other.tree) {}
+
+    reference operator*() const { return {leaf->keys[idx], leaf->vals[idx]}; }
+    pointer operator->() const { return {**this}; }
+
+    Iterator& operator++() {
+      if (++idx == leaf->count) {
+        leaf = leaf->next;
+        idx = 0;
+      }
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    Iterator& operator--() {
+      if (!leaf) {
+        leaf = tree->lastLeaf();
+        idx = leaf->count;
+      } else if (idx == 0) {
+        leaf = leaf->prev;
+        idx = leaf->count;
+      }
+      idx--;
+      return *this;
+    }
+
+    Iterator operator--(int) {
+      Iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    friend bool operator==(const Iterator& a, const Iterator& b) {
+      return a.leaf == b.leaf && a.idx == b.idx;
+    }
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  BTreeMap() : root(nullptr), sz(0), curr(nullptr), currIdx(0) {}
+
+  BTreeMap(const BTreeMap& other) : root(nullptr), sz(0), curr(nullptr), currIdx(0) {
+    Leaf* lastLeaf = nullptr;
+    if (other.root) root = cloneSubtree(other.root, lastLeaf);
+    sz = other.sz;
+  }
+
+  BTreeMap(BTreeMap&& other) noexcept
+      : root(other.root), sz(other.sz), curr(other.curr), currIdx(other.currIdx) {
+    other.root = nullptr;
+    other.curr = nullptr;
+    other.sz = 0;
+  }
+
+  BTreeMap& operator=(const BTreeMap& other) {
+    if (this == &other) return *this;
+    BTreeMap copy(other);
+    swap(copy);
+    return *this;
+  }
+
+  BTreeMap& operator=(BTreeMap&& other) noexcept {
+    if (this == &other) return *this;
+    clear();
+    swap(other);
+    return *this;
+  }
+
+  ~BTreeMap() { clear(); }
+
+  void swap(BTreeMap& other) noexcept {
+    std::swap(root, other.root);
+    std::swap(sz, other.sz);
+    std::swap(curr, other.curr);
+    std::swap(currIdx, other.currIdx);
+  }
+
+  bool empty() const { return sz == 0; }
+
+  size_t size() const { return sz; }
+
+  // Levels from the root to the leaves (0 when empty).
+  size_t height() const {
+    size_t levels = 0;
+    for (Node* node = root; node; node = node->leaf ? nullptr : asInner(node)->children[0]) levels++;
+    return levels;
+  }
+
+  void insert(const KeyT& key, const ValT& value) { insertEntry(key, value); }
+
+  void insert(KeyT&& key, ValT&& value) { insertEntry(std::move(key), std::move(value)); }
+
+  ValT& at(const KeyT& key) const {
+    auto [leaf, i] = findEntry(key);
+    if (!leaf) throw out_of_range("Key not found");
+    return leaf->vals[i];
+  }
+
+  bool contains(const KeyT& key) const { return findEntry(key).first != nullptr; }
+
+  iterator find(const KeyT& key) {
+    auto [leaf, i] = findEntry(key);
+    return iterator(leaf, i, this);
+  }
+
+  const_iterator find(const KeyT& key) const {
+    auto [leaf, i] = findEntry(key);
+    return const_iterator(leaf, i, this);
+  }
+
+  void clear() {
+    deleteSubtree(root);
+    root = nullptr;
+    curr = nullptr;
+    sz = 0;
+  }
+
+  string to_string() const {
+    ostringstream ss;
+    for (Leaf* leaf = firstLeaf(); leaf; leaf = leaf->next) {
+      for (unsigned i = 0; i < leaf->count; i++) ss << leaf->keys[i] << ": " << leaf->vals[i] << '\n';
+    }
+    return ss.str();
+  }
+
+  pair<KeyT, ValT> remove_min() {
+    if (!root) throw runtime_error("Tree is empty");
+    KeyT key = firstLeaf()->keys[0];
+    return eraseEntry(key);
+  }
+
+  ValT erase(const KeyT& key) { return eraseEntry(key).second; }
+
+  bool operator==(const BTreeMap& other) const {
+    if (sz != other.sz) return false;
+    for (auto a = begin(), b = other.begin(); a != end(); ++a, ++b) {
+      if (a.leaf->keys[a.idx] != b.leaf->keys[b.idx] || a.leaf->vals[a.idx] != b.leaf->vals[b.idx])
+        return false;
+    }
+    return true;
+  }
+
+  // The non-const begin() also rewinds the legacy next() cursor.
+  iterator begin() {
+    curr = firstLeaf();
+    currIdx = 0;
+    return iterator(curr, 0, this);
+  }
+
+  const_iterator begin() const { return const_iterator(firstLeaf(), 0, this); }
+  const_iterator cbegin() const { return begin(); }
+
+  iterator end() { return iterator(nullptr, 0, this); }
+  const_iterator end() const { return const_iterator(nullptr, 0, this); }
+  const_iterator cend() const { return end(); }
+
+  bool next(KeyT& key, ValT& val) {
+    if (!curr) return false;
+    key = curr->keys[currIdx];
+    val = curr->vals[currIdx];
+    if (++currIdx == curr->count) {
+      curr = curr->next;
+      currIdx = 0;
+    }
+    return true;
+  }
+
+  void* getRoot() const { return this->root; }
+};
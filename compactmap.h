@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// AVL map for very large maps of small entries. Nodes live in one vector
+// and link to each other by 32-bit index instead of pointer, with no parent
+// link, so an int -> int entry takes 20 bytes where an AVL BSTMap node
+// takes 48. Whatever BSTMap does by climbing parent pointers, rebalancing
+// and the next() cursor do here with an explicit stack of the path from
+// the root. Erased slots go on a free list for the next insert; they keep
+// their moved-from key and value until then.
+//
+// Holds at most 2^32 - 1 entries. Keys need == and <, and keys and values
+// must be move assignable.
+template <typename KeyT, typename ValT>
+class CompactBSTMap {
+ private:
+  using Index = uint32_t;
+  static constexpr Index Null = numeric_limits<Index>::max();
+
+  // An AVL tree of 2^32 nodes is at most 46 levels high.
+  static constexpr size_t MaxHeight = 48;
+
+  struct Node {
+    KeyT key;
+    ValT value;
+    Index left;  // next free slot while the node is on the free list
+    Index right;
+    uint8_t height;
+  };
+
+  vector<Node> nodes;
+  Index root;
+  Index freeList;
+  size_t sz;
+  vector<Index> cursor;  // next() stack: nodes whose entry and right subtree are still to come
+
+  int heightOf(Index i) const { return i == Null ? 0 : nodes[i].height; }
+
+  void updateHeight(Index i) {
+    nodes[i].height = uint8_t(1 + max(heightOf(nodes[i].left), heightOf(nodes[i].right)));
+  }
+
+  Index rotateLeft(Index i) {
+    Index pivot = nodes[i].right;
+    nodes[i].right = nodes[pivot].left;
+    nodes[pivot].left = i;
+    updateHeight(i);
+    updateHeight(pivot);
+    return pivot;
+  }
+
+  Index rotateRight(Index i) {
+    Index pivot = nodes[i].left;
+    nodes[i].left = nodes[pivot].right;
+    nodes[pivot].right = i;
+    updateHeight(i);
+    updateHeight(pivot);
+    return pivot;
+  }
+
+  // Refreshes i's height and fixes an imbalance of two with a single or
+  // double rotation; returns the subtree's new root.
+  Index balanceNode(Index i) {
+    updateHeight(i);
+    int balance = heightOf(nodes[i].left) - heightOf(nodes[i].right);
+    if (balance > 1) {
+      Index l = nodes[i].left;
+      if (heightOf(nodes[l].left) < heightOf(nodes[l].right)) nodes[i].left = rotateLeft(l);
+      return rotateRight(i);
+    }
+    if (balance < -1) {
+      Index r = nodes[i].right;
+      if (heightOf(nodes[r].right) < heightOf(nodes[r].left)) nodes[i].right = rotateRight(r);
+      return rotateLeft(i);
+    }
+    return i;
+  }
+
+  // Points whatever held old (parent's child link or the root) at child.
+  void relink(Index parent, Index old, Index child) {
+    if (parent == Null) root = child;
+    else if (nodes[parent].left == old) nodes[parent].left = child;
+    else nodes[parent].right = child;
+  }
+
+  // Rebalances path[0..depth) bottom-up after the subtree under
+  // path[depth - 1] changed. Stops as soon as a subtree keeps its height.
+  void rebalancePath(const Index* path, size_t depth) {
+    while (depth > 0) {
+      Index i = path[--depth];
+      int before = nodes[i].height;
+      Index top = balanceNode(i);
+      if (top != i) relink(depth ? path[depth - 1] : Null, i, top);
+      else if (nodes[i].height == before) return;
+    }
+  }
+
+  // The descents test for the key first and then pick the child with a
+  // conditional move; testing < both ways is a branch the CPU mispredicts
+  // on every other level.
+  Index findIndex(const KeyT& key) const {
+    Index i = root;
+    while (i != Null && !(nodes[i].key == key)) i = key < nodes[i].key ? nodes[i].left : nodes[i].right;
+    return i;
+  }
+
+  template <typename K, typename V>
+  Index newNode(K&& key, V&& value) {
+    if (freeList != Null) {
+      Index i = freeList;
+      Node& node = nodes[i];
+      freeList = node.left;
+      node.key = std::forward<K>(key);
+      node.value = std::forward<V>(value);
+      node.left = node.right = Null;
+      node.height = 1;
+      return i;
+    }
+    if (nodes.size() == Null) throw length_error("CompactBSTMap is full");
+    nodes.push_back(Node{std::forward<K>(key), std::forward<V>(value), Null, Null, 1});
+    return Index(nodes.size() - 1);
+  }
+
+  template <typename K, typename V>
+  void insertEntry(K&& key, V&& value) {
+    Index path[MaxHeight];
+    size_t depth = 0;
+    Index i = root;
+    bool goLeft = false;
+    while (i != Null) {
+      if (nodes[i].key == key) return;
+      goLeft = key < nodes[i].key;
+      path[depth++] = i;
+      i = goLeft ? nodes[i].left : nodes[i].right;
+    }
+    Index added = newNode(std::forward<K>(key), std::forward<V>(value));
+    sz++;
+    if (depth == 0) {
+      root = added;
+      return;
+    }
+    if (goLeft) nodes[path[depth - 1]].left = added;
+    else nodes[path[depth - 1]].right = added;
+    rebalancePath(path, depth);
+  }
+
+  // Unlinks path[depth - 1] and returns its entry. A node with two children
+  // is replaced by its in-order successor, which is relinked into its place
+  // and takes its slot on the path, so no other entry moves.
+  pair<KeyT, ValT> eraseAt(Index* path, size_t depth) {
+    Index i = path[depth - 1];
+    Index parent = depth > 1 ? path[depth - 2] : Null;
+    Node& node = nodes[i];
+    if (node.left != Null && node.right != Null) {
+      size_t slot = depth - 1;
+      Index next = node.right;
+      path[depth++] = next;
+      while (nodes[next].left != Null) {
+        next = nodes[next].left;
+        path[depth++] = next;
+      }
+      depth--;  // next itself leaves the path below i
+      if (next != node.right) {
+        nodes[path[depth - 1]].left = nodes[next].right;
+        nodes[next].right = node.right;
+      }
+      nodes[next].left = node.left;
+      nodes[next].height = node.height;
+      relink(parent, i, next);
+      path[slot] = next;
+    } else {
+      relink(parent, i, node.left != Null ? node.left : node.right);
+      depth--;
+    }
+    pair<KeyT, ValT> result = {std::move(node.key), std::move(node.value)};
+    node.left = freeList;
+    freeList = i;
+    sz--;
+    rebalancePath(path, depth);
+    return result;
+  }
+
+  void pushLeftSpine(vector<Index>& stack, Index i) const {
+    for (; i != Null; i = nodes[i].left) stack.push_back(i);
+  }
+
+ public:
+  CompactBSTMap() : root(Null), freeList(Null), sz(0) {}
+
+  CompactBSTMap(const CompactBSTMap& other) = default;
+
+  CompactBSTMap(CompactBSTMap&& other) noexcept
+      : nodes(std::move(other.nodes)),
+        root(exchange(other.root, Null)),
+        freeList(exchange(other.freeList, Null)),
+        sz(exchange(other.sz, 0)),
+        cursor(std::move(other.cursor)) {}
+
+  CompactBSTMap& operator=(const CompactBSTMap& other) {
+    if (this == &other) return *this;
+    CompactBSTMap copy(other);
+    swap(copy);
+    return *this;
+  }
+
+  CompactBSTMap& operator=(CompactBSTMap&& other) noexcept {
+    if (this == &other) return *this;
+    CompactBSTMap moved(std::move(other));
+    swap(moved);
+    return *this;
+  }
+
+  void swap(CompactBSTMap& other) noexcept {
+    nodes.swap(other.nodes);
+    std::swap(root, other.root);
+    std::swap(freeList, other.freeList);
+    std::swap(sz, other.sz);
+    cursor.swap(other.cursor);
+  }
+
+  bool empty() const { return sz == 0; }
+
+  size_t size() const { return sz; }
+
+  // Node slots to allocate up front, so filling a map of known size never
+  // copies the node array.
+  void reserve(size_t n) { nodes.reserve(n); }
+
+  // Bytes held by the node array, free slots and spare capacity included.
+  size_t memory_bytes() const { return nodes.capacity() * sizeof(Node); }
+
+  int height() const { return heightOf(root); }
+
+  void insert(const KeyT& key, const ValT& value) { insertEntry(key, value); }
+
+  void insert(KeyT&& key, ValT&& value) { insertEntry(std::move(key), std::move(value)); }
+
+  ValT& at(const KeyT& key) {
+    Index i = findIndex(key);
+    if (i == Null) throw out_of_range("Key not found");
+    return nodes[i].value;
+  }
+
+  const ValT& at(const KeyT& key) const {
+    Index i = findIndex(key);
+    if (i == Null) throw out_of_range("Key not found");
+    return nodes[i].value;
+  }
+
+  bool contains(const KeyT& key) const { return findIndex(key) != Null; }
+
+  ValT erase(const KeyT& key) {
+    Index path[MaxHeight];
+    size_t depth = 0;
+    for (Index i = root; i != Null; i = key < nodes[i].key ? nodes[i].left : nodes[i].right) {
+      path[depth++] = i;
+      if (nodes[i].key == key) return eraseAt(path, depth).second;
+    }
+    throw out_of_range("Key not found");
+  }
+
+  pair<KeyT, ValT> remove_min() {
+    if (root == Null) throw runtime_error("Tree is empty");
+    Index path[MaxHeight];
+    size_t depth = 0;
+    for (Index i = root; i != Null; i = nodes[i].left) path[depth++] = i;
+    return eraseAt(path, depth);
+  }
+
+  // Frees the node array along with the entries.
+  void clear() {
+    vector<Node>().swap(nodes);
+    root = freeList = Null;
+    sz = 0;
+    cursor.clear();
+  }
+
+  string to_string() const {
+    ostringstream ss;
+    vector<Index> stack;
+    pushLeftSpine(stack, root);
+    while (!stack.empty()) {
+      const Node& node = nodes[stack.back()];
+      stack.pop_back();
+      ss << node.key << ": " << node.value << '\n';
+      pushLeftSpine(stack, node.right);
+    }
+    return ss.str();
+  }
+
+  bool operator==(const CompactBSTMap& other) const {
+    if (sz != other.sz) return false;
+    vector<Index> mine, theirs;
+    pushLeftSpine(mine, root);
+    other.pushLeftSpine(theirs, other.root);
+    while (!mine.empty()) {
+      const Node& a = nodes[mine.back()];
+      const Node& b = other.nodes[theirs.back()];
+      if (a.key != b.key || a.value != b.value) return false;
+      mine.pop_back();
+      theirs.pop_back();
+      pushLeftSpine(mine, a.right);
+      other.pushLeftSpine(theirs, b.right);
+    }
+    return true;
+  }
+
+  // Rewinds the next() cursor to the smallest entry. Any insert or erase
+  // invalidates the cursor until the next begin().
+  void begin() {
+    cursor.clear();
+    pushLeftSpine(cursor, root);
+  }
+
+  bool next(KeyT& key, ValT& val) {
+    if (cursor.empty()) return false;
+    const Node& node = nodes[cursor.back()];
+    cursor.pop_back();
+    key = node.key;
+    val = node.value;
+    pushLeftSpine(cursor, node.right);
+    return true;
+  }
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// AVL map that many threads can query while others update it. Nodes are
+// immutable once published: a writer copies the search path it changes,
+// then swings the root pointer to the new version with one atomic store,
+// so a reader always walks a consistent tree and never takes a lock.
+// Writers are serialised by a mutex.
+//
+// Replaced nodes are reclaimed by epochs. A reader announces the global
+// epoch in a reader slot for the duration of one lookup; a retired node is
+// freed once every announced epoch is newer than the one it was retired
+// in. With more than ReaderSlots concurrent lookups, readers spin until a
+// slot frees up.
+template <typename KeyT, typename ValT, size_t ReaderSlots = 128>
+class ConcurrentBSTMap {
+ private:
+  struct Node {
+    const KeyT key;
+    const ValT value;
+    const Node* const left;
+    const Node* const right;
+    const int height;
+  };
+
+  // Padded so readers on different cores do not share a line.
+  struct alignas(64) ReaderSlot {
+    atomic<uint64_t> epoch{0};  // 0 while idle
+  };
+
+  // Nodes a write has made and nodes it has unlinked. On failure the
+  // former are freed; on success the latter are retired.
+  struct PathCopy {
+    vector<const Node*> created;
+    vector<const Node*> replaced;
+  };
+
+  static constexpr size_t ReclaimBatch = 256;
+
+  atomic<const Node*> root{nullptr};
+  atomic<size_t> sz{0};
+  atomic<uint64_t> epoch{1};
+  mutable ReaderSlot slots[ReaderSlots];
+  mutex writeMutex;
+  PathCopy scratch;  // reused by every write
+  vector<pair<uint64_t, const Node*>> retired;
+  size_t reclaimAt = ReclaimBatch;
+
+  // Holds a reader slot, and with it every node reachable from the root
+  // it loads, until destroyed.
+  class ReadGuard {
+   private:
+    const ConcurrentBSTMap& map;
+    size_t slot;
+
+   public:
+    explicit ReadGuard(const ConcurrentBSTMap& map) : map(map) {
+      static thread_local size_t hint = hash<thread::id>{}(this_thread::get_id());
+      for (slot = hint % ReaderSlots;; slot = (slot + 1) % ReaderSlots) {
+        uint64_t idle = 0;
+        if (map.slots[slot].epoch.compare_exchange_weak(idle, map.epoch.load())) break;
+      }
+    }
+
+    ~ReadGuard() { map.slots[slot].epoch.store(0, memory_order_release); }
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+  };
+
+  static int heightOf(const Node* node) { return node ? node->height : 0; }
+
+  static const Node* findNode(const Node* node, const KeyT& key) {
+    while (node && !(node->key == key)) node = key < node->key ? node->left : node->right;
+    return node;
+  }
+
+  static const Node* makeNode(PathCopy& path, const KeyT& key, const ValT& value, const Node* left,
+                              const Node* right) {
+    const Node* node = new Node{key, value, left, right, max(heightOf(left), heightOf(right)) + 1};
+    path.created.push_back(node);
+    return node;
+  }
+
+  // New node over left and right, rotated once or twice if their heights
+  // differ by two. Rotated-away children are recorded as replaced.
+  static const Node* balance(PathCopy& path, const KeyT& key, const ValT& value, const Node* left,
+                             const Node* right) {
+    if (heightOf(left) > heightOf(right) + 1) {
+      path.replaced.push_back(left);
+      if (heightOf(left->left) >= heightOf(left->right)) {
+        return makeNode(path, left->key, left->value, left->left,
+                        makeNode(path, key, value, left->right, right));
+      }
+      const Node* pivot = left->right;
+      path.replaced.push_back(pivot);
+      return makeNode(path, pivot->key, pivot->value,
+                      makeNode(path, left->key, left->value, left->left, pivot->left),
+                      makeNode(path, key, value, pivot->right, right));
+    }
+    if (heightOf(right) > heightOf(left) + 1) {
+      path.replaced.push_back(right);
+      if (heightOf(right->right) >= heightOf(right->left)) {
+        return makeNode(path, right->key, right->value, makeNode(path, key, value, left, right->left),
+                        right->right);
+      }
+      const Node* pivot = right->left;
+      path.replaced.push_back(pivot);
+      return makeNode(path, pivot->key, pivot->value, makeNode(path, key, value, left, pivot->left),
+                      makeNode(path, right->key, right->value, pivot->right, right->right));
+    }
+    return makeNode(path, key, value, left, right);
+  }
+
+  // Returns the new version of the subtree, or node itself if key exists.
+  static const Node* insertPath(PathCopy& path, const Node* node, const KeyT& key, const ValT& value) {
+    if (!node) return makeNode(path, key, value, nullptr, nullptr);
+    if (node->key == key) return node;
+    if (key < node->key) {
+      const Node* left = insertPath(path, node->left, key, value);
+      if (left == node->left) return node;
+      path.replaced.push_back(node);
+      return balance(path, node->key, node->value, left, node->right);
+    }
+    const Node* right = insertPath(path, node->right, key, value);
+    if (right == node->right) return node;
+    path.replaced.push_back(node);
+    return balance(path, node->key, node->value, node->left, right);
+  }
+
+  static const Node* removeMin(PathCopy& path, const Node* node, const Node*& minNode) {
+    path.replaced.push_back(node);
+    if (!node->left) {
+      minNode = node;
+      return node->right;
+    }
+    const Node* left = removeMin(path, node->left, minNode);
+    return balance(path, node->key, node->value, left, node->right);
+  }
+
+  // Returns the new version of the subtree and sets removed to the node
+  // holding key, or returns node itself if key is absent.
+  static const Node* erasePath(PathCopy& path, const Node* node, const KeyT& key, const Node*& removed) {
+    if (!node) return nullptr;
+    if (node->key == key) {
+      removed = node;
+      if (!node->left || !node->right) {
+        path.replaced.push_back(node);
+        return node->left ? node->left : node->right;
+      }
+      const Node* minNode;
+      const Node* right = removeMin(path, node->right, minNode);
+      path.replaced.push_back(node);
+      return balance(path, minNode->key, minNode->value, node->left, right);
+    }
+    if (key < node->key) {
+      const Node* left = erasePath(path, node->left, key, removed);
+      if (!removed) return node;
+      path.replaced.push_back(node);
+      return balance(path, node->key, node->value, left, node->right);
+    }
+    const Node* right = erasePath(path, node->right, key, removed);
+    if (!removed) return node;
+    path.replaced.push_back(node);
+    return balance(path, node->key, node->value, node->left, right);
+  }
+
+  // A path copy makes at most three nodes per level; reserving up front
+  // keeps the bookkeeping from throwing once nodes exist.
+  static void startPath(PathCopy& path, const Node* top) {
+    size_t bound = 4 * (heightOf(top) + 2);
+    path.created.clear();
+    path.replaced.clear();
+    path.created.reserve(bound);
+    path.replaced.reserve(bound);
+  }
+
+  static void deleteSubtree(const Node* node) {
+    if (!node) return;
+    deleteSubtree(node->left);
+    deleteSubtree(node->right);
+    delete node;
+  }
+
+  // Publishes the new root and retires the replaced nodes under the epoch
+  // that was current when they became unreachable.
+  void publish(const Node* newRoot, const vector<const Node*>& replaced) {
+    retired.reserve(retired.size() + replaced.size());
+    root.store(newRoot);
+    uint64_t retiredIn = epoch.fetch_add(1);
+    for (const Node* node : replaced) retired.emplace_back(retiredIn, node);
+    if (retired.size() >= reclaimAt) reclaim();
+  }
+
+  // Frees every retired node that no active reader can still reach. Nodes
+  // pinned by a slow reader push the next scan further out, so a write
+  // never pays for rescanning the same survivors.
+  void reclaim() {
+    uint64_t oldest = numeric_limits<uint64_t>::max();
+    for (const ReaderSlot& slot : slots) {
+      uint64_t announced = slot.epoch.load();
+      if (announced != 0) oldest = min(oldest, announced);
+    }
+    auto reachable = partition(retired.begin(), retired.end(),
+                               [&](const pair<uint64_t, const Node*>& entry) { return entry.first >= oldest; });
+    for (auto it = reachable; it != retired.end(); ++it) delete it->second;
+    retired.erase(reachable, retired.end());
+    reclaimAt = max(ReclaimBatch, 2 * retired.size());
+  }
+
+ public:
+  ConcurrentBSTMap() = default;
+
+  ConcurrentBSTMap(const ConcurrentBSTMap&) = delete;
+  ConcurrentBSTMap& operator=(const ConcurrentBSTMap&) = delete;
+
+  // No lookups may be running.
+  ~ConcurrentBSTMap() {
+    deleteSubtree(root.load());
+    for (const auto& entry : retired) delete entry.second;
+  }
+
+  bool empty() const { return sz.load() == 0; }
+  size_t size() const { return sz.load(); }
+
+  // Returns a copy of the value: the node may be reclaimed as soon as the
+  // lookup ends.
+  ValT at(const KeyT& key) const {
+    ReadGuard guard(*this);
+    const Node* node = findNode(root.load(), key);
+    if (!node) throw out_of_range("Key not found");
+    return node->value;
+  }
+
+  bool contains(const KeyT& key) const {
+    ReadGuard guard(*this);
+    return findNode(root.load(), key) != nullptr;
+  }
+
+  // Adds key unless it is already present.
+  void insert(const KeyT& key, const ValT& value) {
+    lock_guard<mutex> lock(writeMutex);
+    const Node* oldRoot = root.load(memory_order_relaxed);
+    startPath(scratch, oldRoot);
+    try {
+      const Node* newRoot = insertPath(scratch, oldRoot, key, value);
+      if (newRoot == oldRoot) return;
+      publish(newRoot, scratch.replaced);
+    } catch (...) {
+      for (const Node* node : scratch.created) delete node;
+      throw;
+    }
+    sz.fetch_add(1);
+  }
+
+  ValT erase(const KeyT& key) {
+    lock_guard<mutex> lock(writeMutex);
+    const Node* oldRoot = root.load(memory_order_relaxed);
+    startPath(scratch, oldRoot);
+    const Node* removed = nullptr;
+    bool published = false;
+    try {
+      const Node* newRoot = erasePath(scratch, oldRoot, key, removed);
+      if (!removed) throw out_of_range("Key not found");
+      ValT value = removed->value;
+      publish(newRoot, scratch.replaced);
+      published = true;
+      sz.fetch_sub(1);
+      return value;
+    } catch (...) {
+      if (!published) {
+        for (const Node* node : scratch.created) delete node;
+      }
+      throw;
+    }
+  }
+
+  void clear() {
+    lock_guard<mutex> lock(writeMutex);
+    vector<const Node*> all;
+    all.reserve(sz.load());
+    vector<const Node*> stack;
+    if (const Node* top = root.load(memory_order_relaxed)) stack.push_back(top);
+    while (!stack.empty()) {
+      const Node* node = stack.back();
+      stack.pop_back();
+      all.push_back(node);
+      if (node->left) stack.push_back(node->left);
+      if (node->right) stack.push_back(node->right);
+    }
+    publish(nullptr, all);
+    sz.store(0);
+  }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Hands out arrays starting on a cache line boundary.
+template <typename T>
+struct CacheLineAllocator {
+  using value_type = T;
+
+  static constexpr align_val_t alignment{64};
+
+  CacheLineAllocator() = default;
+  template <typename U>
+  CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), alignment)); }
+  void deallocate(T* p, size_t) { ::operator delete(p, alignment); }
+
+  template <typename U>
+  bool operator==(const CacheLineAllocator<U>&) const { return true; }
+};
+
+// Immutable sorted map for data that is loaded once and then only queried.
+// Keys sit in an implicit search tree stored in BFS (Eytzinger) order, with
+// values in a parallel array, so a lookup is a fixed sequence of array
+// reads with no pointers to chase. Arithmetic keys are grouped B to a cache
+// line and each block is ranked with one vector compare (AVX2 intrinsics
+// for integral keys when built with -mavx2); other keys use the plain
+// one-key-per-node layout. Keys and values must be default constructible.
+// Compare is a less-than predicate; the vector compares are only used when
+// it is plain <.
+template <typename KeyT, typename ValT, typename Compare = less<KeyT>>
+class FrozenMap {
+ private:
+  // Keys per search block; block k has children k * (B + 1) + 1 ... + B + 1.
+  static constexpr size_t B = is_arithmetic_v<KeyT> ? 64 / sizeof(KeyT) : 1;
+
+  static constexpr bool isPlainLess = is_same_v<Compare, less<KeyT>> || is_same_v<Compare, less<>>;
+
+  vector<KeyT, CacheLineAllocator<KeyT>> keys;
+  vector<ValT> vals;
+  size_t sz = 0;
+  size_t blocks = 0;
+  [[no_unique_address]] Compare comp;
+
+#ifdef __AVX2__
+  // Unsigned keys are compared as signed ones after flipping the top bit.
+  static unsigned simdRank(const KeyT* block, KeyT key) {
+    const __m256i* lanes = reinterpret_cast<const __m256i*>(block);
+    unsigned less = 0;
+    if constexpr (sizeof(KeyT) == 4) {
+      __m256i flip = _mm256_set1_epi32(is_signed_v<KeyT> ? 0 : numeric_limits<int32_t>::min());
+      __m256i x = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int32_t>(key)), flip);
+      for (size_t i = 0; i < B / 8; i++) {
+        __m256i y = _mm256_xor_si256(_mm256_load_si256(lanes + i), flip);
+        less |= unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, y)))) << (8 * i);
+      }
+    } else {
+      __m256i flip = _mm256_set1_epi64x(is_signed_v<KeyT> ? 0 : numeric_limits<int64_t>::min());
+      __m256i x = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(key)), flip);
+      for (size_t i = 0; i < B / 4; i++) {
+        __m256i y = _mm256_xor_si256(_mm256_load_si256(lanes + i), flip);
+        less |= unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, y)))) << (4 * i);
+      }
+    }
+    return popcount(less);
+  }
+#endif
+
+  // Number of keys in block that are less than key.
+  unsigned blockRank(const KeyT* block, const KeyT& key) const {
+#ifdef __AVX2__
+    if constexpr (isPlainLess && is_integral_v<KeyT> && (sizeof(KeyT) == 4 || sizeof(KeyT) == 8)) {
+      return simdRank(block, key);
+    }
+#endif
+    unsigned less = 0;
+    for (size_t i = 0; i < B; i++) less += comp(block[i], key);
+    return less;
+  }
+
+  // Slot of the first key not less than key, or keys.size(). The loop has
+  // no data-dependent branches: the candidate is kept with a conditional
+  // move, and in the one-key layout the node four levels down is
+  // prefetched while the levels in between are searched.
+  size_t lowerBoundSlot(const KeyT& key) const {
+    const KeyT* base = keys.data();
+    size_t found = keys.size();
+    size_t k = 0;
+    while (k < blocks) {
+      if constexpr (B == 1) __builtin_prefetch(base + min(16 * k + 15, blocks - 1));
+      size_t i = blockRank(base + k * B, key);
+      found = i < B ? k * B + i : found;
+      k = k * (B + 1) + i + 1;
+    }
+    return found;
+  }
+
+  // Writes the entries from it into block k's subtree in key order. Slots
+  // past the last entry repeat the largest key, which keeps every block
+  // sorted and never wins a search over the real entry.
+  template <typename It>
+  void fill(size_t k, It& it, size_t& filled, const KeyT*& prev) {
+    if (k >= blocks) return;
+    for (size_t i = 0; i <= B; i++) {
+      fill(k * (B + 1) + i + 1, it, filled, prev);
+      if (i == B) break;
+      KeyT& slotKey = keys[k * B + i];
+      if (filled < sz) {
+        auto&& [key, value] = *it;
+        slotKey = key;
+        vals[k * B + i] = value;
+        if (prev && !comp(*prev, slotKey)) throw invalid_argument("Keys are not sorted and unique");
+        prev = &slotKey;
+        ++it;
+      } else {
+        slotKey = *prev;
+      }
+      filled++;
+    }
+  }
+
+  template <typename Fn>
+  void visit(size_t k, size_t& left, Fn& fn) const {
+    if (k >= blocks) return;
+    for (size_t i = 0; i <= B && left > 0; i++) {
+      visit(k * (B + 1) + i + 1, left, fn);
+      if (i == B || left == 0) break;
+      fn(keys[k * B + i], vals[k * B + i]);
+      left--;
+    }
+  }
+
+ public:
+  FrozenMap() = default;
+
+  // Builds the map from entries sorted by strictly increasing key, as comp
+  // orders them. Throws invalid_argument if the order is violated.
+  template <typename It>
+  FrozenMap(It first, It last, const Compare& comp = Compare())
+      : sz(distance(first, last)), blocks((sz + B - 1) / B), comp(comp) {
+    keys.resize(blocks * B);
+    vals.resize(blocks * B);
+    size_t filled = 0;
+    const KeyT* prev = nullptr;
+    fill(0, first, filled, prev);
+  }
+
+  bool empty() const { return sz == 0; }
+  size_t size() const { return sz; }
+
+  // Bytes of key and value storage, padding included.
+  size_t memory_bytes() const { return keys.size() * (sizeof(KeyT) + sizeof(ValT)); }
+
+  // The value stored for key, or nullptr.
+  const ValT* find(const KeyT& key) const {
+    size_t slot = lowerBoundSlot(key);
+    if (slot == keys.size() || comp(key, keys[slot])) return nullptr;
+    return &vals[slot];
+  }
+
+  bool contains(const KeyT& key) const { return find(key) != nullptr; }
+
+  const ValT& at(const KeyT& key) const {
+    const ValT* value = find(key);
+    if (!value) throw out_of_range("Key not found");
+    return *value;
+  }
+
+  // Calls fn(key, value) for every entry in key order.
+  template <typename Fn>
+  void for_each(Fn fn) const {
+    size_t left = sz;
+    visit(0, left, fn);
+  }
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+// Encodes values of type T for BSTMap::save and load. encode appends the
+// bytes for value to out; decode reads one value starting at p, advances p
+// past it and throws runtime_error if the bytes run out before end.
+// Specialize it for key and value types that are not trivially copyable.
+template <typename T>
+struct MapCodec;
+
+// Trivially copyable types are stored as their raw bytes. A map whose key
+// and value both use this codec is saved as two flat arrays that load()
+// reads in place from the mapped file.
+template <typename T>
+  requires is_trivially_copyable_v<T>
+struct MapCodec<T> {
+  static constexpr bool is_raw = true;
+
+  static void encode(string& out, const T& value) { out.append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+  static T decode(const char*& p, const char* end) {
+    if (static_cast<size_t>(end - p) < sizeof(T)) throw runtime_error("Truncated map file");
+    T value;
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+  }
+};
+
+// Strings are stored as a 64-bit length followed by the characters.
+template <>
+struct MapCodec<string> {
+  static void encode(string& out, const string& value) {
+    MapCodec<uint64_t>::encode(out, value.size());
+    out.append(value);
+  }
+
+  static string decode(const char*& p, const char* end) {
+    uint64_t length = MapCodec<uint64_t>::decode(p, end);
+    if (static_cast<uint64_t>(end - p) < length) throw runtime_error("Truncated map file");
+    string value(p, length);
+    p += length;
+    return value;
+  }
+};
+
+// Fixed header at the start of every map file. Integers are in the byte
+// order of the machine that wrote the file.
+struct MapFileHeader {
+  static constexpr char Magic[8] = {'B', 'S', 'T', 'M', 'A', 'P', '0', '1'};
+  static constexpr uint32_t Encoded = 0;  // records of encoded key, value
+  static constexpr uint32_t Raw = 1;      // all keys, then all values
+  static constexpr size_t DataOffset = 64;  // records start on a cache line
+
+  char magic[8];
+  uint32_t layout;
+  uint32_t keySize;  // sizeof the raw key and value types, 0 when encoded
+  uint32_t valSize;
+  uint32_t reserved;
+  uint64_t count;
+};
+
+// Read-only view of a whole file mapped into memory.
+class MappedFile {
+ private:
+  const char* bytes = nullptr;
+  size_t length = 0;
+
+ public:
+  explicit MappedFile(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Cannot open " + path);
+    struct stat info;
+    if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+      length = static_cast<size_t>(info.st_size);
+      void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        bytes = static_cast<const char*>(mapped);
+        ::madvise(mapped, length, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(fd);
+    if (!bytes) throw runtime_error("Cannot map " + path);
+  }
+
+  ~MappedFile() { ::munmap(const_cast<char*>(bytes), length); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return bytes; }
+  size_t size() const { return length; }
+};
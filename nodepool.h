@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// Chunk storage shared by every copy of a NodePool.
+template <size_t MaxChunkSlots>
+struct NodeSlab {
+  struct FreeSlot {
+    FreeSlot* next;
+  };
+
+  vector<char*> chunks;
+  FreeSlot* freeList = nullptr;
+  char* bump = nullptr;
+  char* bumpEnd = nullptr;
+  size_t slotSize = 0;  // fixed by the first pooled allocation
+  size_t nextChunkSlots = 16;
+
+  ~NodeSlab() { release(); }
+
+  void release() {
+    for (char* chunk : chunks) ::operator delete(chunk);
+    chunks.clear();
+    freeList = nullptr;
+    bump = bumpEnd = nullptr;
+    nextChunkSlots = 16;
+  }
+
+  void* allocate() {
+    if (freeList) {
+      FreeSlot* slot = freeList;
+      freeList = slot->next;
+      return slot;
+    }
+    if (bump == bumpEnd) {
+      size_t bytes = nextChunkSlots * slotSize;
+      chunks.reserve(chunks.size() + 1);
+      bump = static_cast<char*>(::operator new(bytes));
+      bumpEnd = bump + bytes;
+      chunks.push_back(bump);
+      nextChunkSlots = min(nextChunkSlots * 2, MaxChunkSlots);
+    }
+    void* slot = bump;
+    bump += slotSize;
+    return slot;
+  }
+
+  void deallocate(void* p) {
+    FreeSlot* slot = static_cast<FreeSlot*>(p);
+    slot->next = freeList;
+    freeList = slot;
+  }
+};
+
+// Slab allocator for node-based containers. Single-object allocations are
+// carved out of contiguous chunks and recycled through an intrusive free
+// list; anything else (arrays, over-aligned types) goes to operator new.
+//
+// Copies and rebound copies share one pool, so nodes can be handed between
+// containers that share an allocator. A container that copy-constructs gets
+// a fresh pool instead (see select_on_container_copy_construction). The pool
+// is not thread-safe; containers sharing one must be used from one thread.
+template <typename T, size_t MaxChunkSlots = 4096>
+class NodePool {
+  template <typename, size_t>
+  friend class NodePool;
+
+  using Pool = NodeSlab<MaxChunkSlots>;
+
+  // sizeof(T) is already a multiple of alignof(T); the rounding only keeps
+  // the free-list link aligned for small T.
+  static constexpr size_t linkAlign = alignof(typename Pool::FreeSlot);
+  static constexpr size_t slotBytes =
+      (max(sizeof(T), sizeof(typename Pool::FreeSlot)) + linkAlign - 1) / linkAlign * linkAlign;
+
+  shared_ptr<Pool> pool;
+
+  static constexpr bool overAligned = alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+  bool pooled(size_t n) const {
+    if (n != 1 || overAligned) return false;
+    if (pool->slotSize == 0) pool->slotSize = slotBytes;
+    return pool->slotSize == slotBytes;
+  }
+
+ public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = true_type;
+  using propagate_on_container_swap = true_type;
+  using is_always_equal = false_type;
+
+  template <typename U>
+  struct rebind {
+    using other = NodePool<U, MaxChunkSlots>;
+  };
+
+  NodePool() : pool(make_shared<Pool>()) {}
+
+  // No move constructor on purpose: a moved-from allocator must still be
+  // usable and equal to the moved-to one, so moving shares the pool too.
+  NodePool(const NodePool& other) = default;
+  NodePool& operator=(const NodePool& other) = default;
+
+  template <typename U>
+  NodePool(const NodePool<U, MaxChunkSlots>& other) : pool(other.pool) {}
+
+  T* allocate(size_t n) {
+    if (pooled(n)) return static_cast<T*>(pool->allocate());
+    if constexpr (overAligned) return static_cast<T*>(::operator new(n * sizeof(T), align_val_t{alignof(T)}));
+    else return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (pooled(n)) pool->deallocate(p);
+    else if constexpr (overAligned) ::operator delete(p, align_val_t{alignof(T)});
+    else ::operator delete(p);
+  }
+
+  NodePool select_on_container_copy_construction() const { return NodePool(); }
+
+  // True when no other allocator copy refers to this pool, i.e. the caller
+  // knows about every live allocation.
+  bool sole_owner() const { return pool.use_count() == 1; }
+
+  // True when single objects of T come from the pool's chunks, so release()
+  // frees them; the rest go to operator new and must be deallocated.
+  bool pooled() const { return !overAligned && pool->slotSize == slotBytes; }
+
+  // Returns every chunk to the system at once. All objects allocated from
+  // the pool must already be destroyed (or be trivially destructible).
+  void release() { pool->release(); }
+
+  // Slots currently reserved in chunks, live or free.
+  size_t capacity() const {
+    size_t slots = 0;
+    size_t chunkSlots = 16;
+    for (size_t i = 0; i < pool->chunks.size(); i++) {
+      slots += chunkSlots;
+      chunkSlots = min(chunkSlots * 2, MaxChunkSlots);
+    }
+    return slots;
+  }
+
+  template <typename U>
+  bool operator==(const NodePool<U, MaxChunkSlots>& other) const {
+    return pool == other.pool;
+  }
+};
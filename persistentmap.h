@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// AVL map whose copies share structure. Nodes are immutable and reference
+// counted, so copying the map (or calling snapshot()) only bumps the root's
+// count, and an update copies just the O(log n) nodes on its search path
+// while every untouched subtree stays shared with older versions.
+//
+// Counts are atomic: a snapshot can be read on one thread while the map it
+// came from is updated on another. A single map object is not thread-safe.
+template <typename KeyT, typename ValT>
+class PersistentBSTMap {
+ private:
+  struct Node {
+    const KeyT key;
+    const ValT value;
+    const Node* const left;  // owned references
+    const Node* const right;
+    const int height;
+    mutable atomic<uint32_t> refs{1};
+  };
+
+  // Owning reference to a node; releases it on destruction.
+  class NodeRef {
+   private:
+    const Node* node;
+
+   public:
+    explicit NodeRef(const Node* node = nullptr) : node(node) {}
+    NodeRef(NodeRef&& other) noexcept : node(exchange(other.node, nullptr)) {}
+    NodeRef& operator=(NodeRef&& other) noexcept {
+      std::swap(node, other.node);
+      return *this;
+    }
+    ~NodeRef() { releaseNode(node); }
+
+    const Node* get() const { return node; }
+    const Node* release() { return exchange(node, nullptr); }
+  };
+
+  NodeRef root;
+  size_t sz;
+
+  static NodeRef share(const Node* node) {
+    if (node) node->refs.fetch_add(1, memory_order_relaxed);
+    return NodeRef(node);
+  }
+
+  static void releaseNode(const Node* node) {
+    if (node && node->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+      releaseNode(node->left);
+      releaseNode(node->right);
+      delete node;
+    }
+  }
+
+  static int heightOf(const Node* node) { return node ? node->height : 0; }
+
+  static const Node* findNode(const Node* node, const KeyT& key) {
+    while (node && !(node->key == key)) node = key < node->key ? node->left : node->right;
+    return node;
+  }
+
+  // The children are only handed over once the node exists, so a throwing
+  // copy of key or value releases them instead of leaking them.
+  static NodeRef makeNode(const KeyT& key, const ValT& value, NodeRef left, NodeRef right) {
+    int height = max(heightOf(left.get()), heightOf(right.get())) + 1;
+    const Node* node = new Node{key, value, left.get(), right.get(), height};
+    left.release();
+    right.release();
+    return NodeRef(node);
+  }
+
+  // New node over left and right, rotated once or twice if their heights
+  // differ by two. Rotated-away children are copied, never modified.
+  static NodeRef balance(const KeyT& key, const ValT& value, NodeRef left, NodeRef right) {
+    const Node* l = left.get();
+    const Node* r = right.get();
+    if (heightOf(l) > heightOf(r) + 1) {
+      if (heightOf(l->left) >= heightOf(l->right)) {
+        return makeNode(l->key, l->value, share(l->left), makeNode(key, value, share(l->right), std::move(right)));
+      }
+      const Node* pivot = l->right;
+      return makeNode(pivot->key, pivot->value, makeNode(l->key, l->value, share(l->left), share(pivot->left)),
+                      makeNode(key, value, share(pivot->right), std::move(right)));
+    }
+    if (heightOf(r) > heightOf(l) + 1) {
+      if (heightOf(r->right) >= heightOf(r->left)) {
+        return makeNode(r->key, r->value, makeNode(key, value, std::move(left), share(r->left)), share(r->right));
+      }
+      const Node* pivot = r->left;
+      return makeNode(pivot->key, pivot->value, makeNode(key, value, std::move(left), share(pivot->left)),
+                      makeNode(r->key, r->value, share(pivot->right), share(r->right)));
+    }
+    return makeNode(key, value, std::move(left), std::move(right));
+  }
+
+  // New version of the subtree at node with key added; key must be absent.
+  static NodeRef insertPath(const Node* node, const KeyT& key, const ValT& value) {
+    if (!node) return makeNode(key, value, NodeRef(), NodeRef());
+    if (key < node->key) {
+      NodeRef left = insertPath(node->left, key, value);
+      return balance(node->key, node->value, std::move(left), share(node->right));
+    }
+    NodeRef right = insertPath(node->right, key, value);
+    return balance(node->key, node->value, share(node->left), std::move(right));
+  }
+
+  static NodeRef removeMin(const Node* node) {
+    if (!node->left) return share(node->right);
+    NodeRef left = removeMin(node->left);
+    return balance(node->key, node->value, std::move(left), share(node->right));
+  }
+
+  // New version of the subtree at node with key removed; key must be
+  // present.
+  static NodeRef erasePath(const Node* node, const KeyT& key) {
+    if (node->key == key) {
+      if (!node->left) return share(node->right);
+      if (!node->right) return share(node->left);
+      const Node* next = node->right;
+      while (next->left) next = next->left;
+      NodeRef right = removeMin(node->right);
+      return balance(next->key, next->value, share(node->left), std::move(right));
+    }
+    if (key < node->key) {
+      NodeRef left = erasePath(node->left, key);
+      return balance(node->key, node->value, std::move(left), share(node->right));
+    }
+    NodeRef right = erasePath(node->right, key);
+    return balance(node->key, node->value, share(node->left), std::move(right));
+  }
+
+ public:
+  PersistentBSTMap() : sz(0) {}
+
+  // O(1): the copy shares every node with other.
+  PersistentBSTMap(const PersistentBSTMap& other) : root(share(other.root.get())), sz(other.sz) {}
+
+  PersistentBSTMap(PersistentBSTMap&& other) noexcept : root(std::move(other.root)), sz(exchange(other.sz, 0)) {}
+
+  PersistentBSTMap& operator=(PersistentBSTMap other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(PersistentBSTMap& other) noexcept {
+    std::swap(root, other.root);
+    std::swap(sz, other.sz);
+  }
+
+  // Point-in-time copy of the map in O(1).
+  PersistentBSTMap snapshot() const { return *this; }
+
+  bool empty() const { return sz == 0; }
+  size_t size() const { return sz; }
+
+  int height() const { return heightOf(root.get()); }
+
+  // Adds key unless it is already present.
+  void insert(const KeyT& key, const ValT& value) {
+    if (contains(key)) return;
+    root = insertPath(root.get(), key, value);
+    sz++;
+  }
+
+  ValT erase(const KeyT& key) {
+    const Node* node = findNode(root.get(), key);
+    if (!node) throw out_of_range("Key not found");
+    ValT value = node->value;
+    root = erasePath(root.get(), key);
+    sz--;
+    return value;
+  }
+
+  // The reference stays valid until this map is next modified.
+  const ValT& at(const KeyT& key) const {
+    const Node* node = findNode(root.get(), key);
+    if (!node) throw out_of_range("Key not found");
+    return node->value;
+  }
+
+  bool contains(const KeyT& key) const { return findNode(root.get(), key) != nullptr; }
+
+  void clear() {
+    root = NodeRef();
+    sz = 0;
+  }
+
+  // Calls fn(key, value) for every entry in key order.
+  template <typename Fn>
+  void for_each(Fn fn) const {
+    vector<const Node*> stack;
+    const Node* node = root.get();
+    while (node || !stack.empty()) {
+      for (; node; node = node->left) stack.push_back(node);
+      node = stack.back();
+      stack.pop_back();
+      fn(node->key, node->value);
+      node = node->right;
+    }
+  }
+
+  string to_string() const {
+    ostringstream ss;
+    for_each([&](const KeyT& key, const ValT& value) { ss << key << ": " << value << '\n'; });
+    return ss.str();
+  }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bstmap.h"
+
+using namespace std;
+
+// BSTMap split by key hash into Shards independent trees, each behind its
+// own mutex, so writers that land on different shards run in parallel.
+// Point operations lock one shard; ordered traversals lock every shard (in
+// index order, so they cannot deadlock with each other) and merge.
+template <typename KeyT, typename ValT, size_t Shards = 16, typename Balance = AVLBalance,
+          typename Hash = hash<KeyT>>
+class ShardedBSTMap {
+  static_assert(Shards > 0, "ShardedBSTMap needs at least one shard");
+
+ private:
+  using Map = BSTMap<KeyT, ValT, Balance>;
+
+  // Padded so locks of neighbouring shards do not share a cache line.
+  struct alignas(64) Shard {
+    mutable mutex lock;
+    Map map;
+  };
+
+  Shard shards[Shards];
+  atomic<size_t> sz{0};
+  [[no_unique_address]] Hash hasher;
+
+  Shard& shardFor(const KeyT& key) { return shards[hasher(key) % Shards]; }
+  const Shard& shardFor(const KeyT& key) const { return shards[hasher(key) % Shards]; }
+
+  vector<unique_lock<mutex>> lockAll() const {
+    vector<unique_lock<mutex>> locks;
+    locks.reserve(Shards);
+    for (const Shard& shard : shards) locks.emplace_back(shard.lock);
+    return locks;
+  }
+
+ public:
+  ShardedBSTMap() = default;
+
+  ShardedBSTMap(const ShardedBSTMap&) = delete;
+  ShardedBSTMap& operator=(const ShardedBSTMap&) = delete;
+
+  bool empty() const { return sz.load() == 0; }
+  size_t size() const { return sz.load(); }
+
+  // Adds key unless it is already present.
+  void insert(const KeyT& key, const ValT& value) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    if (shard.map.try_emplace(key, value).second) sz.fetch_add(1);
+  }
+
+  ValT erase(const KeyT& key) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    ValT value = shard.map.erase(key);
+    sz.fetch_sub(1);
+    return value;
+  }
+
+  // Returns a copy, since the entry may change once the shard is unlocked.
+  ValT at(const KeyT& key) const {
+    const Shard& shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.map.at(key);
+  }
+
+  bool contains(const KeyT& key) const {
+    const Shard& shard = shardFor(key);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.map.contains(key);
+  }
+
+  void clear() {
+    auto locks = lockAll();
+    for (Shard& shard : shards) shard.map.clear();
+    sz.store(0);
+  }
+
+  // Calls fn(key, value) for every entry in key order, merging the shards
+  // with a heap of cursors. Every shard stays locked for the whole walk,
+  // so fn sees one consistent state and must not call back into the map.
+  template <typename Fn>
+  void for_each(Fn fn) const {
+    using Cursor = pair<typename Map::const_iterator, typename Map::const_iterator>;
+    auto locks = lockAll();
+    vector<Cursor> heap;
+    heap.reserve(Shards);
+    for (const Shard& shard : shards) {
+      if (!shard.map.empty()) heap.emplace_back(shard.map.cbegin(), shard.map.cend());
+    }
+    auto later = [](const Cursor& a, const Cursor& b) { return b.first->first < a.first->first; };
+    make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+      pop_heap(heap.begin(), heap.end(), later);
+      auto& [it, end] = heap.back();
+      fn(it->first, it->second);
+      if (++it == end) heap.pop_back();
+      else push_heap(heap.begin(), heap.end(), later);
+    }
+  }
+
+  // Same format as BSTMap::to_string.
+  string to_string() const {
+    ostringstream ss;
+    for_each([&](const KeyT& key, const ValT& value) { ss << key << ": " << value << '\n'; });
+    return ss.str();
+  }
+};